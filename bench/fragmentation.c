@@ -0,0 +1,361 @@
+// Replay an allocation trace against mymalloc5, and analyze the fragmentation of its heap at the peak
+// of live data (or after a given event), by walking the heap.
+//
+//   make MALLOC=mymalloc5 RELEASE=1 && make bench/fragmentation MALLOC=mymalloc5
+//   ./bench/fragmentation python.trace [event]
+//
+// Reports the occupancy of each chunk, a histogram of free block sizes next to the sizes the trace
+// requests, external fragmentation (how much of the free memory is outside of the largest free block),
+// and the share of the mapped memory taken by metadata and by rounding up requests. Free blocks are
+// held in place by their allocated neighbours, so the requested sizes and ages of the objects next
+// to free blocks show which allocations to give their own size classes.
+#define _GNU_SOURCE
+#include "../mymalloc.h"
+#include "trace_map.h"
+
+#define N_BUCKETS 48
+
+/// Entries of the heap walk, in address order
+typedef struct Walk
+{
+    HeapEntry *entries;
+    size_t count;
+    size_t capacity;
+} Walk;
+
+/// Objects next to free blocks, grouped by the power of two of their requested size
+typedef struct Pinning
+{
+    size_t objects;
+    size_t free_bytes; // Bytes of the free blocks next to them
+    uint64_t age;      // Sum of their ages in events
+} Pinning;
+
+static size_t live_bytes = 0;
+static size_t requests[N_BUCKETS]; // Allocations of the whole trace per size bucket
+
+/// Bucket of a size: bucket b holds sizes of [2^(b-1), 2^b)
+static size_t bucket(size_t size)
+{
+    size_t b = size == 0 ? 0 : 64 - __builtin_clzll(size);
+    return b < N_BUCKETS ? b : N_BUCKETS - 1;
+}
+
+static void print_bucket(size_t b)
+{
+    if (b == 0)
+        printf("%10s", "0");
+    else
+        printf("%10zu", (size_t)1 << (b - 1));
+}
+
+/// Collect the entries of the walk. The walk holds the heap, so they go to C library memory.
+static void collect(const HeapEntry *entry, void *arg)
+{
+    Walk *walk = arg;
+    if (walk->count == walk->capacity)
+    {
+        walk->capacity = walk->capacity ? walk->capacity << 1 : 4096;
+        walk->entries = realloc(walk->entries, walk->capacity * sizeof(HeapEntry));
+        if (walk->entries == NULL)
+            exit(EXIT_FAILURE);
+    }
+    walk->entries[walk->count++] = *entry;
+}
+
+/// Live objects of the trace, sorted by their replayed address
+static Object *live_objects;
+static size_t n_live;
+
+static int compare_objects(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)((const Object *)a)->ptr, y = (uintptr_t)((const Object *)b)->ptr;
+    return x < y ? -1 : x > y;
+}
+
+/// Find the live object inside a block
+static Object *object_in(const HeapEntry *block)
+{
+    size_t lo = 0, hi = n_live;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) >> 1;
+        if ((char *)live_objects[mid].ptr < (char *)block->start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < n_live && (char *)live_objects[lo].ptr < (char *)block->start + block->size)
+        return &live_objects[lo];
+    return NULL;
+}
+
+static void replay(const TraceEvent *event)
+{
+    size_t i;
+    char *ptr = NULL;
+    switch (event->op)
+    {
+    case kTraceMalloc:
+        ptr = my_malloc(event->size);
+        break;
+    case kTraceCalloc:
+        ptr = my_calloc(1, event->size);
+        break;
+    case kTraceAlignedAlloc:
+        ptr = my_aligned_alloc(event->arg, event->size);
+        break;
+    case kTraceRealloc:
+        i = find(event->arg);
+        if (objects[i].key == 0)
+        {
+            ptr = my_malloc(event->size);
+            break;
+        }
+        live_bytes -= objects[i].size;
+        ptr = my_realloc(objects[i].ptr, event->size);
+        erase(i);
+        break;
+    case kTraceFree:
+        i = find(event->ptr);
+        if (objects[i].key != 0)
+        {
+            live_bytes -= objects[i].size;
+            my_free(objects[i].ptr);
+            erase(i);
+        }
+        return;
+    default:
+        return;
+    }
+    if (ptr == NULL)
+    {
+        fprintf(stderr, "out of memory allocating %zu bytes\n", (size_t)event->size);
+        exit(EXIT_FAILURE);
+    }
+    i = find(event->ptr);
+    if (objects[i].key != 0)
+    {
+        // The free of the recorded object was lost
+        live_bytes -= objects[i].size;
+        my_free(objects[i].ptr);
+    }
+    objects[i] = (Object){.key = event->ptr, .ptr = ptr, .base = ptr, .size = event->size, .seq = event->seq};
+    live_bytes += event->size;
+}
+
+/// Find the event after which the most bytes are live, without allocating
+static size_t find_peak(const TraceEvent *events, size_t n_events)
+{
+    size_t peak = 0, peak_bytes = 0;
+    for (size_t e = 0; e < n_events; e++)
+    {
+        const TraceEvent *event = &events[e];
+        size_t i;
+        if (event->op == kTraceRealloc && objects[i = find(event->arg)].key != 0)
+        {
+            live_bytes -= objects[i].size;
+            erase(i);
+        }
+        if (event->op == kTraceFree)
+        {
+            if (objects[i = find(event->ptr)].key != 0)
+            {
+                live_bytes -= objects[i].size;
+                erase(i);
+            }
+        }
+        else if (event->op < kTraceFree)
+        {
+            requests[bucket(event->size)] += 1;
+            if (objects[i = find(event->ptr)].key != 0)
+                live_bytes -= objects[i].size;
+            objects[i] = (Object){.key = event->ptr, .size = event->size};
+            live_bytes += event->size;
+        }
+        if (live_bytes > peak_bytes)
+        {
+            peak_bytes = live_bytes;
+            peak = e;
+        }
+    }
+    memset(objects, 0, sizeof(Object) << capacity_bits);
+    live_bytes = 0;
+    return peak;
+}
+
+/// Print the occupancy of each chunk. Blocks may span merged chunks, so they are clipped to each chunk.
+static void report_chunks(const Walk *walk)
+{
+    printf("\nchunks:\n%18s %6s %10s %10s %10s %9s\n", "address", "kind", "size_kb", "used_kb", "free_kb", "occupancy");
+    size_t block = 0;
+    for (size_t c = 0; c < walk->count; c++)
+    {
+        const HeapEntry *chunk = &walk->entries[c];
+        if (chunk->kind != kHeapBlockChunk && chunk->kind != kHeapSlabChunk)
+            continue;
+        size_t start = (size_t)chunk->start, end = start + chunk->size;
+        size_t used = 0, free = 0;
+        if (chunk->kind == kHeapSlabChunk)
+        {
+            for (size_t p = c + 1; p < walk->count && walk->entries[p].kind == kHeapSlabPage; p++)
+            {
+                const HeapEntry *page = &walk->entries[p];
+                used += (page->n_objects - page->n_free) * page->usable;
+                free += page->n_free * page->usable;
+            }
+        }
+        else
+        {
+            // Blocks are in address order, and so are the chunks
+            for (; block < walk->count; block++)
+            {
+                const HeapEntry *b = &walk->entries[block];
+                if (b->kind != kHeapBlock)
+                    continue;
+                size_t b_start = (size_t)b->start, b_end = b_start + b->size;
+                if (b_start >= end)
+                    break;
+                if (b_end > start)
+                {
+                    size_t bytes = (b_end < end ? b_end : end) - (b_start > start ? b_start : start);
+                    if (b->free)
+                        free += bytes;
+                    else
+                        used += bytes;
+                }
+                // Keep a block that extends into the next chunk
+                if (b_end > end)
+                    break;
+            }
+        }
+        printf("%18p %6s %10zu %10zu %10zu %8.1f%%\n", chunk->start, chunk->kind == kHeapSlabChunk ? "slab" : "blocks",
+               chunk->size >> 10, used >> 10, free >> 10, used * 100.0 / chunk->size);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3)
+    {
+        fprintf(stderr, "usage: %s <trace> [event]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t n_events, n_threads;
+    TraceEvent *events = load_trace(argv[1], &n_events, &n_threads);
+    init_objects(n_events);
+    size_t snapshot = find_peak(events, n_events);
+    if (argc == 3)
+        snapshot = strtoul(argv[2], NULL, 10);
+    if (snapshot >= n_events)
+    {
+        fprintf(stderr, "the trace has %zu events\n", n_events);
+        return EXIT_FAILURE;
+    }
+    for (size_t e = 0; e <= snapshot; e++)
+        replay(&events[e]);
+
+    Walk walk = {0};
+    my_heap_walk(collect, &walk);
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    // Live objects by address, to find the objects of the blocks
+    live_objects = malloc((n_events + 1) * sizeof(Object));
+    n_live = 0;
+    size_t requested = 0, usable = 0;
+    for (size_t i = 0; i < (1ull << capacity_bits); i++)
+    {
+        if (objects[i].key == 0)
+            continue;
+        live_objects[n_live++] = objects[i];
+        requested += objects[i].size;
+        usable += my_malloc_usable_size(objects[i].ptr);
+    }
+    qsort(live_objects, n_live, sizeof(Object), compare_objects);
+
+    size_t block_chunk_bytes = 0, block_bytes = 0, metadata = 0;
+    size_t free_bytes = 0, largest_free = 0;
+    size_t free_counts[N_BUCKETS] = {0}, free_sizes[N_BUCKETS] = {0};
+    Pinning pinning[N_BUCKETS];
+    memset(pinning, 0, sizeof(pinning));
+    const HeapEntry *left = NULL;
+    for (size_t i = 0; i < walk.count; i++)
+    {
+        const HeapEntry *entry = &walk.entries[i];
+        if (entry->kind == kHeapBlockChunk)
+            block_chunk_bytes += entry->size;
+        else if (entry->kind == kHeapSlabPage)
+            metadata += entry->size - entry->n_objects * entry->usable;
+        if (entry->kind != kHeapBlock)
+            continue;
+        block_bytes += entry->size;
+        if (!entry->free)
+        {
+            metadata += entry->size - entry->usable;
+        }
+        else
+        {
+            free_bytes += entry->size;
+            if (entry->size > largest_free)
+                largest_free = entry->size;
+            free_counts[bucket(entry->size)] += 1;
+            free_sizes[bucket(entry->size)] += entry->size;
+            // The allocated neighbours of the free block hold it in place
+            const HeapEntry *right = NULL;
+            for (size_t j = i + 1; j < walk.count && right == NULL; j++)
+                right = walk.entries[j].kind == kHeapBlock ? &walk.entries[j] : NULL;
+            const HeapEntry *neighbours[2] = {left, right};
+            for (size_t k = 0; k < 2; k++)
+            {
+                const HeapEntry *n = neighbours[k];
+                bool adjacent = n != NULL && (k == 0 ? (char *)n->start + n->size == entry->start : (char *)entry->start + entry->size == n->start);
+                Object *object = adjacent && !n->free ? object_in(n) : NULL;
+                if (object == NULL)
+                    continue;
+                Pinning *p = &pinning[bucket(object->size)];
+                p->objects += 1;
+                p->free_bytes += entry->size;
+                p->age += events[snapshot].seq - object->seq;
+            }
+        }
+        left = entry;
+    }
+    // Fences between the blocks of the chunks
+    metadata += block_chunk_bytes - block_bytes;
+
+    printf("snapshot after event %zu of %zu: live=%zuKB mapped=%zuKB in_use=%zuKB free=%zuKB chunks=%zu\n", snapshot, n_events,
+           live_bytes >> 10, stats.mapped >> 10, stats.in_use >> 10, stats.free >> 10, stats.chunks);
+    printf("external fragmentation: %.1f%% (largest free block %zuKB of %zuKB free)\n",
+           free_bytes ? (1 - (double)largest_free / free_bytes) * 100 : 0.0, largest_free >> 10, free_bytes >> 10);
+    printf("metadata overhead: %.1f%% of mapped (%zuKB)\n", stats.mapped ? metadata * 100.0 / stats.mapped : 0.0, metadata >> 10);
+    printf("rounding overhead: %.1f%% of mapped (%zuKB of %zuKB usable for %zuKB requested)\n",
+           stats.mapped ? (usable - requested) * 100.0 / stats.mapped : 0.0, (usable - requested) >> 10, usable >> 10, requested >> 10);
+    report_chunks(&walk);
+
+    printf("\nfree blocks and requests by size:\n%10s %12s %12s %12s\n", "from", "free_blocks", "free_kb", "requests");
+    for (size_t b = 0; b < N_BUCKETS; b++)
+    {
+        if (free_counts[b] == 0 && requests[b] == 0)
+            continue;
+        print_bucket(b);
+        printf(" %12zu %12zu %12zu\n", free_counts[b], free_sizes[b] >> 10, requests[b]);
+    }
+
+    printf("\nobjects next to free blocks, by requested size:\n%10s %12s %12s %12s\n", "from", "objects", "free_kb", "avg_age");
+    // Largest culprits first
+    for (size_t n = 0; n < N_BUCKETS; n++)
+    {
+        size_t worst = N_BUCKETS;
+        for (size_t b = 0; b < N_BUCKETS; b++)
+        {
+            if (pinning[b].objects != 0 && (worst == N_BUCKETS || pinning[b].free_bytes > pinning[worst].free_bytes))
+                worst = b;
+        }
+        if (worst == N_BUCKETS)
+            break;
+        print_bucket(worst);
+        printf(" %12zu %12zu %12zu\n", pinning[worst].objects, pinning[worst].free_bytes >> 10, (size_t)(pinning[worst].age / pinning[worst].objects));
+        pinning[worst].objects = 0;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+// Memory taken by block headers and rounding: allocate a live set of objects of random sizes in a range,
+// walk the heap, and report the bytes of the allocated blocks beyond the requested sizes.
+//
+//   make MALLOC=mymalloc5 RELEASE=1 && make bench/overhead MALLOC=mymalloc5
+//   ./bench/overhead [objects]
+//
+// Sizes are uniform over each range, or multiples of 16 in the aligned ranges, which most C++ and
+// language runtime objects are. Objects up to 256 bytes are slab objects without headers, so the ranges
+// start above them.
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mymalloc.h"
+
+typedef struct Range
+{
+    size_t min;
+    size_t max;
+    size_t step;
+} Range;
+
+static const Range kRanges[] = {
+    {257, 512, 1},
+    {513, 1024, 1},
+    {1025, 4096, 1},
+    {4097, 32768, 1},
+    {272, 1024, 16},
+    {1040, 4096, 16},
+};
+
+/// Bytes of allocated blocks
+static void count_blocks(const HeapEntry *entry, void *arg)
+{
+    if (entry->kind == kHeapBlock && !entry->free)
+        *(size_t *)arg += entry->size;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+    void **ptrs = malloc(n * sizeof(void *));
+    if (ptrs == NULL)
+        return EXIT_FAILURE;
+    // Sampled objects get their own mapping
+    my_set_sample_rate(0);
+    printf("%-12s %8s %12s %12s %14s %9s\n", "sizes", "objects", "requested", "blocks", "bytes/object", "overhead");
+    size_t seed = 42;
+    for (size_t r = 0; r < sizeof(kRanges) / sizeof(kRanges[0]); r++)
+    {
+        const Range *range = &kRanges[r];
+        size_t requested = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            size_t size = range->min + (seed >> 33) % ((range->max - range->min) / range->step + 1) * range->step;
+            ptrs[i] = my_malloc(size);
+            if (ptrs[i] == NULL)
+                return EXIT_FAILURE;
+            requested += size;
+        }
+        size_t blocks = 0;
+        my_heap_walk(count_blocks, &blocks);
+        char name[32];
+        snprintf(name, sizeof(name), "%zu-%zu%s", range->min, range->max, range->step > 1 ? "/16" : "");
+        printf("%-12s %8zu %12zu %12zu %14.2f %8.2f%%\n", name, n, requested, blocks, (double)(blocks - requested) / n,
+               100.0 * (blocks - requested) / requested);
+        for (size_t i = 0; i < n; i++)
+            my_free(ptrs[i]);
+    }
+    free(ptrs);
+    return EXIT_SUCCESS;
+}
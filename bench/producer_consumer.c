@@ -0,0 +1,87 @@
+// Producer/consumer throughput: messages are allocated by one thread and freed by another.
+//
+//   make bench/producer_consumer MALLOC=mymalloc5 THREADS=1 && ./bench/producer_consumer
+//
+// Build with NO_REMOTE_FREE=1 to measure cross-thread frees that take the owner arena's lock.
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mymalloc.h"
+
+#define QUEUE_SIZE 1024
+
+/// Single-producer single-consumer ring buffer
+typedef struct Queue
+{
+    void *slots[QUEUE_SIZE];
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+} Queue;
+
+static size_t n_messages = 1000000;
+static Queue *queues;
+
+static void *producer(void *arg)
+{
+    Queue *queue = arg;
+    size_t seed = (size_t)arg;
+    for (size_t i = 0; i < n_messages; i++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        size_t size = 16 + (seed >> 33) % 1024;
+        char *msg = my_malloc(size);
+        msg[0] = (char)i;
+        size_t tail = queue->tail;
+        while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE)
+            sched_yield();
+        queue->slots[tail % QUEUE_SIZE] = msg;
+        __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    Queue *queue = arg;
+    for (size_t i = 0; i < n_messages; i++)
+    {
+        size_t head = queue->head;
+        while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == head)
+            sched_yield();
+        char *msg = queue->slots[head % QUEUE_SIZE];
+        __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+        my_free(msg);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n_pairs = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    if (argc > 2)
+        n_messages = strtoul(argv[2], NULL, 10);
+    queues = aligned_alloc(64, sizeof(Queue) * n_pairs);
+    memset(queues, 0, sizeof(Queue) * n_pairs);
+    pthread_t *threads = calloc(n_pairs << 1, sizeof(pthread_t));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n_pairs; i++)
+    {
+        pthread_create(&threads[i << 1], NULL, producer, &queues[i]);
+        pthread_create(&threads[(i << 1) + 1], NULL, consumer, &queues[i]);
+    }
+    for (size_t i = 0; i < n_pairs << 1; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    size_t total = n_pairs * n_messages;
+    printf("pairs=%zu messages=%zu time=%.3fs throughput=%.0f msgs/s\n", n_pairs, total, seconds, total / seconds);
+    free(threads);
+    free(queues);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,219 @@
+// Replay an allocation trace against any allocator library, and report its time, peak RSS and fragmentation.
+//
+//   make preload TRACE=1 && MYMALLOC_TRACE=python.trace LD_PRELOAD=./out/libmymalloc5_preload.so python3 ...
+//   make MALLOC=mymalloc3 RELEASE=1 && make bench/replay && ./bench/replay ./out/libmymalloc3.so python.trace
+//
+// Events of all threads are replayed on one thread, in their recorded order. Every page of an object is
+// touched, so RSS follows the allocated sizes. Allocators without my_calloc, my_realloc or my_aligned_alloc
+// get them emulated with my_malloc and my_free.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <time.h>
+#include "trace_map.h"
+
+// RSS is sampled every RSS_SAMPLE_INTERVAL events, and whenever the peak of live data grows by RSS_SAMPLE_BYTES
+#define RSS_SAMPLE_INTERVAL 1024
+#define RSS_SAMPLE_BYTES (1 << 20)
+
+static void *(*lib_malloc)(size_t);
+static void (*lib_free)(void *);
+static void *(*lib_calloc)(size_t, size_t);
+static void *(*lib_realloc)(void *, size_t);
+static void *(*lib_aligned_alloc)(size_t, size_t);
+
+static size_t page_size;
+static int statm_fd;
+
+static size_t live_bytes = 0;
+static size_t peak_live_bytes = 0;
+static size_t skipped = 0;
+
+static void *load(void *lib, const char *name, bool required)
+{
+    void *fn = dlsym(lib, name);
+    if (fn == NULL && required)
+    {
+        fprintf(stderr, "%s is not exported by the allocator\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return fn;
+}
+
+/// Anonymous memory of the process in bytes
+static size_t rss(void)
+{
+    char buf[128];
+    ssize_t n = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    size_t size, resident, shared;
+    if (sscanf(buf, "%zu %zu %zu", &size, &resident, &shared) != 3)
+        return 0;
+    return (resident - shared) * page_size;
+}
+
+/// Write to every page of a range, like a program filling the object would
+static void touch(char *ptr, size_t from, size_t to)
+{
+    for (size_t i = from; i < to; i += page_size)
+        ptr[i] = 1;
+}
+
+static void *emulate_aligned_alloc(size_t alignment, size_t size, char **base)
+{
+    *base = lib_malloc(size + alignment);
+    if (*base == NULL)
+        return NULL;
+    return (void *)(((uintptr_t)*base + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+/// Track a new object
+static void insert(uint64_t key, char *ptr, char *base, size_t size)
+{
+    if (ptr == NULL)
+    {
+        fprintf(stderr, "the allocator ran out of memory allocating %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    size_t i = find(key);
+    if (objects[i].key != 0)
+    {
+        // The free of the recorded object was lost
+        lib_free(objects[i].base);
+        live_bytes -= objects[i].size;
+        skipped += 1;
+    }
+    objects[i] = (Object){.key = key, .ptr = ptr, .base = base, .size = size};
+    live_bytes += size;
+    if (live_bytes > peak_live_bytes)
+        peak_live_bytes = live_bytes;
+}
+
+static void replay(const TraceEvent *event)
+{
+    size_t size = event->size;
+    char *ptr, *base;
+    switch (event->op)
+    {
+    case kTraceMalloc:
+        ptr = lib_malloc(size);
+        insert(event->ptr, ptr, ptr, size);
+        touch(ptr, 0, size);
+        break;
+    case kTraceCalloc:
+        if (lib_calloc != NULL)
+            ptr = lib_calloc(1, size);
+        else if ((ptr = lib_malloc(size)) != NULL)
+            memset(ptr, 0, size);
+        insert(event->ptr, ptr, ptr, size);
+        touch(ptr, 0, size);
+        break;
+    case kTraceAlignedAlloc:
+        if (lib_aligned_alloc != NULL)
+            base = ptr = lib_aligned_alloc(event->arg, size);
+        else
+            ptr = emulate_aligned_alloc(event->arg, size, &base);
+        insert(event->ptr, ptr, base, size);
+        touch(ptr, 0, size);
+        break;
+    case kTraceRealloc:
+    {
+        size_t i = find(event->arg);
+        if (objects[i].key == 0)
+        {
+            // The allocation of the recorded object was lost
+            skipped += 1;
+            ptr = lib_malloc(size);
+            insert(event->ptr, ptr, ptr, size);
+            touch(ptr, 0, size);
+            break;
+        }
+        Object old = objects[i];
+        erase(i);
+        live_bytes -= old.size;
+        if (lib_realloc != NULL && old.ptr == old.base)
+            ptr = lib_realloc(old.ptr, size);
+        else if ((ptr = lib_malloc(size)) != NULL)
+        {
+            memcpy(ptr, old.ptr, old.size < size ? old.size : size);
+            lib_free(old.base);
+        }
+        insert(event->ptr, ptr, ptr, size);
+        touch(ptr, old.size, size);
+        break;
+    }
+    case kTraceFree:
+    {
+        size_t i = find(event->ptr);
+        if (objects[i].key == 0)
+        {
+            skipped += 1;
+            break;
+        }
+        lib_free(objects[i].base);
+        live_bytes -= objects[i].size;
+        erase(i);
+        break;
+    }
+    default:
+        skipped += 1;
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <allocator library> <trace>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    void *lib = dlopen(argv[1], RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+    *(void **)&lib_malloc = load(lib, "my_malloc", true);
+    *(void **)&lib_free = load(lib, "my_free", true);
+    *(void **)&lib_calloc = load(lib, "my_calloc", false);
+    *(void **)&lib_realloc = load(lib, "my_realloc", false);
+    *(void **)&lib_aligned_alloc = load(lib, "my_aligned_alloc", false);
+
+    size_t n_events, n_threads;
+    TraceEvent *events = load_trace(argv[2], &n_events, &n_threads);
+    init_objects(n_events);
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    statm_fd = open("/proc/self/statm", O_RDONLY);
+
+    size_t base_rss = rss();
+    size_t peak_rss = base_rss;
+    size_t sampled_live_bytes = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n_events; i++)
+    {
+        replay(&events[i]);
+        if (i % RSS_SAMPLE_INTERVAL == 0 || peak_live_bytes >= sampled_live_bytes + RSS_SAMPLE_BYTES)
+        {
+            sampled_live_bytes = peak_live_bytes;
+            size_t bytes = rss();
+            if (bytes > peak_rss)
+                peak_rss = bytes;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t final_rss = rss();
+    if (final_rss > peak_rss)
+        peak_rss = final_rss;
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    peak_rss -= base_rss;
+    // Share of the peak RSS that never held live data
+    double fragmentation = peak_rss > peak_live_bytes ? 1 - (double)peak_live_bytes / peak_rss : 0;
+    printf("events=%zu threads=%zu time=%.3fs ns_per_event=%.1f peak_live=%zuKB peak_rss=%zuKB fragmentation=%.1f%% skipped=%zu\n",
+           n_events, n_threads, seconds, seconds * 1e9 / (n_events ? n_events : 1), peak_live_bytes >> 10, peak_rss >> 10,
+           fragmentation * 100, skipped);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+// dTLB misses and throughput of a heap of small objects that are visited in random order.
+//
+//   make bench/thp MALLOC=mymalloc5 RELEASE=1 && ./bench/thp
+//   make clean && make bench/thp MALLOC=mymalloc5 RELEASE=1 HUGEPAGES=1 && ./bench/thp
+//
+// Compare the two runs to see the effect of backing chunks with transparent huge pages.
+// dTLB misses are read with perf_event_open, and are reported as n/a if perf events are not available.
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "../mymalloc.h"
+
+/// An object of the heap, linked into a random cycle
+typedef struct Node
+{
+    struct Node *next;
+    size_t value;
+} Node;
+
+/// Open a counter of dTLB load misses of this thread, or return -1
+static int open_dtlb_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counter(int fd)
+{
+    if (fd < 0)
+        return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void print_counter(int fd)
+{
+    long long count;
+    if (fd < 0 || (ioctl(fd, PERF_EVENT_IOC_DISABLE, 0), read(fd, &count, sizeof(count))) != sizeof(count))
+        printf(" dtlb_misses=n/a");
+    else
+        printf(" dtlb_misses=%lld", count);
+}
+
+/// Anonymous memory backed by huge pages, in KB
+static size_t anon_huge_pages(void)
+{
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL)
+        return 0;
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n_objects = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000000;
+    size_t n_passes = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    Node **nodes = malloc(n_objects * sizeof(Node *));
+    int fd = open_dtlb_counter();
+    struct timespec start;
+
+    // Objects of slab and small block size classes
+    start_counter(fd);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t seed = 1;
+    for (size_t i = 0; i < n_objects; i++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        nodes[i] = my_malloc(sizeof(Node) + (seed >> 33) % 496);
+        nodes[i]->value = i;
+    }
+    double seconds = elapsed(&start);
+    printf("alloc: objects=%zu time=%.3fs throughput=%.0f allocs/s", n_objects, seconds, n_objects / seconds);
+    print_counter(fd);
+    printf("\n");
+
+    // Link the objects into a random cycle
+    for (size_t i = n_objects - 1; i > 0; i--)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        size_t j = (seed >> 33) % (i + 1);
+        Node *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
+    for (size_t i = 0; i < n_objects; i++)
+        nodes[i]->next = nodes[(i + 1) % n_objects];
+
+    // Visit them
+    start_counter(fd);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t sum = 0;
+    Node *node = nodes[0];
+    for (size_t i = 0; i < n_objects * n_passes; i++)
+    {
+        sum += node->value;
+        node = node->next;
+    }
+    seconds = elapsed(&start);
+    printf("visit: loads=%zu time=%.3fs throughput=%.0f loads/s", n_objects * n_passes, seconds, n_objects * n_passes / seconds);
+    print_counter(fd);
+    printf(" checksum=%zu\n", sum);
+
+    printf("anon_huge_pages=%zuKB\n", anon_huge_pages());
+
+    // Free in random order
+    start_counter(fd);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n_objects; i++)
+        my_free(nodes[i]);
+    seconds = elapsed(&start);
+    printf("free: objects=%zu time=%.3fs throughput=%.0f frees/s", n_objects, seconds, n_objects / seconds);
+    print_counter(fd);
+    printf("\n");
+
+    if (fd >= 0)
+        close(fd);
+    free(nodes);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+// Loading of allocation traces, and the map of recorded to replayed objects, shared by the replay tools
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../trace.h"
+
+/// A live object of the trace
+typedef struct Object
+{
+    uint64_t key;  // Recorded address, 0 for an empty slot
+    char *ptr;     // Replayed address
+    char *base;    // Address to free, if aligned allocations are emulated
+    size_t size;
+    uint64_t seq;  // Event that allocated the object
+} Object;
+
+// Open addressing map of recorded to replayed objects
+static Object *objects;
+static size_t capacity_bits;
+
+static int compare_events(const void *a, const void *b)
+{
+    uint64_t x = ((const TraceEvent *)a)->seq, y = ((const TraceEvent *)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/// Map a trace and sort its events, which threads wrote in batches. Exits if the file is not a trace.
+static TraceEvent *load_trace(const char *path, size_t *n_events, size_t *n_threads)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceHeader))
+    {
+        fprintf(stderr, "cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    char *file = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    TraceHeader *header = (TraceHeader *)file;
+    if (file == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->event_size != sizeof(TraceEvent))
+    {
+        fprintf(stderr, "%s is not a trace of this format\n", path);
+        exit(EXIT_FAILURE);
+    }
+    TraceEvent *events = (TraceEvent *)(file + sizeof(TraceHeader));
+    *n_events = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceEvent);
+    *n_threads = 0;
+    bool sorted = true;
+    for (size_t i = 0; i < *n_events; i++)
+    {
+        if (events[i].thread >= *n_threads)
+            *n_threads = events[i].thread + 1;
+        sorted = sorted && (i == 0 || events[i - 1].seq < events[i].seq);
+    }
+    if (!sorted)
+        qsort(events, *n_events, sizeof(TraceEvent), compare_events);
+    return events;
+}
+
+/// Allocate an empty map for the objects of a trace of `n_events` events
+static void init_objects(size_t n_events)
+{
+    // At most every event allocates, and the map stays at most half full
+    for (capacity_bits = 4; (1ull << capacity_bits) < n_events * 2; capacity_bits++)
+        ;
+    objects = mmap(NULL, sizeof(Object) << capacity_bits, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (objects == MAP_FAILED)
+        exit(EXIT_FAILURE);
+    // Fault the map in now, so it does not count towards the memory of the replay
+    memset(objects, 0, sizeof(Object) << capacity_bits);
+}
+
+/// Find the slot of a recorded address, or the empty slot where it would go
+static size_t find(uint64_t key)
+{
+    size_t mask = (1ull << capacity_bits) - 1;
+    size_t i = (key * 0x9e3779b97f4a7c15ull) >> (64 - capacity_bits);
+    while (objects[i].key != 0 && objects[i].key != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/// Empty a slot, moving up the objects that probed past it
+static void erase(size_t i)
+{
+    size_t mask = (1ull << capacity_bits) - 1;
+    size_t j = i;
+    while (true)
+    {
+        objects[i].key = 0;
+        do
+        {
+            j = (j + 1) & mask;
+            if (objects[j].key == 0)
+                return;
+            size_t home = (objects[j].key * 0x9e3779b97f4a7c15ull) >> (64 - capacity_bits);
+            // Stop at an object that may stay where it is
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                continue;
+            break;
+        } while (true);
+        objects[i] = objects[j];
+        i = j;
+    }
+}
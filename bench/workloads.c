@@ -0,0 +1,354 @@
+// Standard allocator workloads, reported as CSV rows of
+// allocator,workload,threads,ops,seconds,ops_per_sec,ns_per_op,peak_rss_kb
+//
+//   make bench RELEASE=1
+//   ./out/bench/workloads-mymalloc5 [scale] [threads] [workload]
+//
+// `make bench` links this file with every allocator, and with the C library malloc as a baseline.
+// An op is one allocation or one free. Each workload runs in a forked child, so its peak RSS is its own.
+// Multi-threaded workloads run on one thread unless the allocator is thread-safe.
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../mymalloc.h"
+
+#ifdef GLIBC
+#define my_malloc malloc
+#define my_free free
+#endif
+
+#ifndef ALLOCATOR
+#define ALLOCATOR "my_malloc"
+#endif
+
+#if defined(ENABLE_THREADS) || defined(GLIBC)
+#define THREAD_SAFE 1
+#else
+#define THREAD_SAFE 0
+#endif
+
+static size_t scale = 1;
+static size_t n_threads = 4;
+
+typedef struct Workload
+{
+    const char *name;
+    size_t (*run)(void); // Returns the number of ops
+    bool threaded;
+} Workload;
+
+inline static size_t next_random(size_t *seed)
+{
+    *seed = *seed * 6364136223846793005ull + 1442695040888963407ull;
+    return *seed >> 33;
+}
+
+static void *alloc(size_t size)
+{
+    void *ptr = my_malloc(size);
+    if (ptr == NULL)
+    {
+        fprintf(stderr, "%s: out of memory allocating %zu bytes\n", ALLOCATOR, size);
+        exit(EXIT_FAILURE);
+    }
+    // Touch the object like a program would
+    *(char *)ptr = 1;
+    return ptr;
+}
+
+/// Run a function on n_threads threads, passing each its index
+static void run_threads(void *(*fn)(void *))
+{
+    pthread_t threads[64];
+    for (size_t i = 0; i < n_threads; i++)
+        pthread_create(&threads[i], NULL, fn, (void *)i);
+    for (size_t i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/// Allocate and free batches of objects of one size
+static size_t fixed(size_t size)
+{
+    void *ptrs[100];
+    size_t rounds = 5000 * scale;
+    for (size_t r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < 100; i++)
+            ptrs[i] = alloc(size);
+        for (size_t i = 0; i < 100; i++)
+            my_free(ptrs[i]);
+    }
+    return rounds * 200;
+}
+
+static size_t fixed_16(void)
+{
+    return fixed(16);
+}
+
+static size_t fixed_256(void)
+{
+    return fixed(256);
+}
+
+static size_t fixed_4096(void)
+{
+    return fixed(4096);
+}
+
+/// Replace random objects of a large live set by objects of random sizes, like tests/random_sizes.c
+static size_t random_churn(void)
+{
+    enum { kSlots = 4096 };
+    static void *ptrs[kSlots];
+    size_t seed = 1;
+    for (size_t i = 0; i < kSlots; i++)
+        ptrs[i] = alloc(1 + next_random(&seed) % 1024);
+    size_t n = 250000 * scale;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t slot = next_random(&seed) % kSlots;
+        my_free(ptrs[slot]);
+        ptrs[slot] = alloc(1 + next_random(&seed) % 1024);
+    }
+    for (size_t i = 0; i < kSlots; i++)
+        my_free(ptrs[i]);
+    return (kSlots + n) << 1;
+}
+
+/// Allocate a batch of objects, and free them in reverse (LIFO) or allocation (FIFO) order
+static size_t stack_or_queue(bool lifo)
+{
+    enum { kObjects = 10000 };
+    static void *ptrs[kObjects];
+    size_t seed = 1;
+    size_t rounds = 25 * scale;
+    for (size_t r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < kObjects; i++)
+            ptrs[i] = alloc(16 + next_random(&seed) % 512);
+        for (size_t i = 0; i < kObjects; i++)
+            my_free(ptrs[lifo ? kObjects - 1 - i : i]);
+    }
+    return rounds * kObjects * 2;
+}
+
+static size_t lifo(void)
+{
+    return stack_or_queue(true);
+}
+
+static size_t fifo(void)
+{
+    return stack_or_queue(false);
+}
+
+// Larson: each thread of a server replaces random objects of its live set, and hands the set over
+// to a new thread every round, so objects are freed by other threads than the ones allocating them.
+enum { kLarsonSlots = 4096 };
+static void **larson_slots;
+static size_t larson_replacements;
+
+static void *larson_worker(void *arg)
+{
+    size_t index = (size_t)arg;
+    size_t seed = index + 1;
+    void **slots = &larson_slots[index * kLarsonSlots];
+    for (size_t i = 0; i < larson_replacements; i++)
+    {
+        size_t slot = next_random(&seed) % kLarsonSlots;
+        my_free(slots[slot]);
+        slots[slot] = alloc(8 + next_random(&seed) % 1000);
+    }
+    return NULL;
+}
+
+static size_t larson(void)
+{
+    size_t rounds = 10;
+    larson_replacements = 25000 * scale / n_threads;
+    larson_slots = calloc(n_threads * kLarsonSlots, sizeof(void *));
+    size_t seed = 1;
+    for (size_t i = 0; i < n_threads * kLarsonSlots; i++)
+        larson_slots[i] = alloc(8 + next_random(&seed) % 1000);
+    for (size_t r = 0; r < rounds; r++)
+    {
+        run_threads(larson_worker);
+        // The next round's threads inherit the sets of their predecessors
+        static void *last[kLarsonSlots];
+        memcpy(last, &larson_slots[(n_threads - 1) * kLarsonSlots], sizeof(last));
+        memmove(&larson_slots[kLarsonSlots], larson_slots, (n_threads - 1) * sizeof(last));
+        memcpy(larson_slots, last, sizeof(last));
+    }
+    for (size_t i = 0; i < n_threads * kLarsonSlots; i++)
+        my_free(larson_slots[i]);
+    free(larson_slots);
+    return (n_threads * kLarsonSlots + rounds * n_threads * larson_replacements) << 1;
+}
+
+// xmalloc: threads allocate batches of objects and publish them on a shared stack, from which
+// any thread pops batches to free.
+enum { kBatchSize = 64 };
+
+typedef struct Batch
+{
+    struct Batch *next;
+    void *objects[kBatchSize];
+} Batch;
+
+static pthread_mutex_t xmalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static Batch *xmalloc_batches;
+static size_t xmalloc_rounds;
+
+static void *xmalloc_worker(void *arg)
+{
+    size_t seed = (size_t)arg + 1;
+    for (size_t r = 0; r < xmalloc_rounds; r++)
+    {
+        Batch *batch = alloc(sizeof(Batch));
+        for (size_t i = 0; i < kBatchSize; i++)
+            batch->objects[i] = alloc(1 + next_random(&seed) % 256);
+        pthread_mutex_lock(&xmalloc_lock);
+        batch->next = xmalloc_batches;
+        xmalloc_batches = batch;
+        // Keep a few batches in flight
+        batch = r % 2 == 1 ? xmalloc_batches : NULL;
+        if (batch != NULL)
+            xmalloc_batches = batch->next;
+        pthread_mutex_unlock(&xmalloc_lock);
+        if (batch == NULL)
+            continue;
+        for (size_t i = 0; i < kBatchSize; i++)
+            my_free(batch->objects[i]);
+        my_free(batch);
+    }
+    return NULL;
+}
+
+static size_t xmalloc(void)
+{
+    xmalloc_rounds = 5000 * scale / n_threads;
+    run_threads(xmalloc_worker);
+    while (xmalloc_batches != NULL)
+    {
+        Batch *batch = xmalloc_batches;
+        xmalloc_batches = batch->next;
+        for (size_t i = 0; i < kBatchSize; i++)
+            my_free(batch->objects[i]);
+        my_free(batch);
+    }
+    return n_threads * xmalloc_rounds * (kBatchSize + 1) * 2;
+}
+
+// cache-scratch: each thread frees a small object allocated by the main thread next to the objects
+// of the other threads, then repeatedly allocates and writes its own. An allocator that hands the
+// freed neighbours to different threads makes them write to the same cache lines.
+static void **scratch_objects;
+static size_t scratch_rounds;
+
+static void *scratch_worker(void *arg)
+{
+    size_t index = (size_t)arg;
+    my_free(scratch_objects[index]);
+    for (size_t r = 0; r < scratch_rounds; r++)
+    {
+        volatile char *object = alloc(8);
+        for (size_t i = 0; i < 1000; i++)
+            object[i % 8] += 1;
+        my_free((void *)object);
+    }
+    return NULL;
+}
+
+static size_t cache_scratch(void)
+{
+    scratch_rounds = 5000 * scale / n_threads;
+    scratch_objects = calloc(n_threads, sizeof(void *));
+    for (size_t i = 0; i < n_threads; i++)
+        scratch_objects[i] = alloc(8);
+    run_threads(scratch_worker);
+    free(scratch_objects);
+    return n_threads * (scratch_rounds + 1) * 2;
+}
+
+static const Workload kWorkloads[] = {
+    {"fixed_16", fixed_16, false},
+    {"fixed_256", fixed_256, false},
+    {"fixed_4096", fixed_4096, false},
+    {"random_churn", random_churn, false},
+    {"lifo", lifo, false},
+    {"fifo", fifo, false},
+    {"larson", larson, true},
+    {"xmalloc", xmalloc, true},
+    {"cache_scratch", cache_scratch, true},
+};
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/// Run a workload in a child process and print its row
+static void bench(const Workload *workload)
+{
+    size_t threads = n_threads;
+    if (!workload->threaded || !THREAD_SAFE)
+        threads = 1;
+    int fds[2];
+    if (pipe(fds) != 0)
+        exit(EXIT_FAILURE);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        n_threads = threads;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t ops = workload->run();
+        double seconds = elapsed(&start);
+        if (write(fds[1], &ops, sizeof(ops)) != sizeof(ops) || write(fds[1], &seconds, sizeof(seconds)) != sizeof(seconds))
+            _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    size_t ops;
+    double seconds;
+    bool ok = read(fds[0], &ops, sizeof(ops)) == sizeof(ops) && read(fds[0], &seconds, sizeof(seconds)) == sizeof(seconds);
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS || !ok)
+    {
+        fprintf(stderr, "%s: %s failed\n", ALLOCATOR, workload->name);
+        return;
+    }
+    printf("%s,%s,%zu,%zu,%.6f,%.0f,%.2f,%ld\n", ALLOCATOR, workload->name, threads, ops, seconds,
+           ops / seconds, seconds * 1e9 / ops, usage.ru_maxrss);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        scale = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        n_threads = strtoul(argv[2], NULL, 10);
+    if (scale == 0 || n_threads == 0 || n_threads > 64)
+    {
+        fprintf(stderr, "usage: %s [scale] [threads (1-64)] [workload]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < sizeof(kWorkloads) / sizeof(kWorkloads[0]); i++)
+        if (argc <= 3 || strcmp(argv[3], kWorkloads[i].name) == 0)
+            bench(&kWorkloads[i]);
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,6 @@
+#pragma once
+
+#include <stdbool.h>
 #include <stddef.h>
 
 #define USE(...)             \
@@ -18,3 +21,83 @@ extern const size_t kMaxAllocationSize;
 
 void *my_malloc(size_t size);
 void my_free(void *p);
+void *my_calloc(size_t count, size_t size);
+void *my_realloc(void *ptr, size_t size);
+void *my_aligned_alloc(size_t alignment, size_t size);
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t my_try_expand(void *ptr, size_t min, size_t max);
+void my_set_purge_decay(size_t decay_ms);
+size_t my_malloc_usable_size(void *ptr);
+/// Free an object of my_malloc, my_calloc or my_realloc given the size it was requested with (or its usable size),
+/// which spares small objects a lookup. Objects of my_aligned_alloc must go through my_free.
+/// CHECK_FREE_SIZE=1 builds check the size against the object.
+void my_free_sized(void *ptr, size_t size);
+/// Allocate `n` objects of `size` bytes into `out`, carving blocks out of one free block where possible.
+/// Returns the number of objects allocated, fewer than `n` only if out of memory.
+size_t my_malloc_batch(size_t size, size_t n, void **out);
+/// Free `n` objects (NULL entries are skipped). `ptrs` is sorted in place, so adjacent blocks are merged and
+/// freed as one block.
+void my_free_batch(void **ptrs, size_t n);
+
+/// Statistics of the allocator, filled by my_malloc_stats
+typedef struct MallocStats
+{
+    size_t mapped;                     // Bytes mapped from the OS
+    size_t in_use;                     // Bytes of allocated blocks, slab objects and huge mappings
+    size_t free;                       // Bytes of free blocks
+    size_t free_by_class[N_LISTS + 1]; // Bytes of free blocks per size class of the lists, then of the general size class
+    size_t largest_free;               // Size of the largest free block
+    size_t chunks;                     // Chunks of the arenas
+    size_t huge_mappings;              // Dedicated mappings of huge allocations
+    size_t mallocs;
+    size_t frees;
+    size_t reallocs;
+    size_t splits;
+    size_t coalesces;
+    size_t mmaps; // Calls to mmap and mremap
+    size_t munmaps;
+} MallocStats;
+
+void my_malloc_stats(MallocStats *stats);
+/// Write the statistics to a file descriptor in the Prometheus text format. Returns -1 if the write fails.
+int my_malloc_stats_print(int fd);
+
+/// What a HeapEntry describes
+typedef enum HeapEntryKind
+{
+    kHeapBlockChunk, // A chunk of blocks. Chunks are reported before their blocks or slab pages.
+    kHeapSlabChunk,  // A chunk of slab pages
+    kHeapBlock,      // A block, which may extend into the next chunks if they were merged
+    kHeapSlabPage,   // A slab page in use
+} HeapEntryKind;
+
+/// A chunk, block or slab page reported by my_heap_walk
+typedef struct HeapEntry
+{
+    HeapEntryKind kind;
+    void *start;      // First byte of the chunk, block or slab page
+    size_t size;      // Bytes of the chunk, block (with its metadata) or slab page
+    size_t usable;    // Usable bytes of a block, or of each object of a slab page
+    bool free;        // Free block, or slab page without allocated objects
+    size_t n_objects; // Objects a slab page can hold,
+    size_t n_free;    // and its free slots
+    size_t arena;
+} HeapEntry;
+
+typedef void (*HeapWalkCallback)(const HeapEntry *entry, void *arg);
+
+/// Report the chunks of the heap in address order, each followed by its blocks or slab pages.
+/// Objects held by thread caches are reported as allocated, and huge allocations are not reported.
+/// The heap is locked during the walk, so the callback must not call the allocator.
+void my_heap_walk(HeapWalkCallback callback, void *arg);
+
+/// Sample an allocation every `bytes` allocated bytes on average (PROFILE=1 builds). 0 stops sampling.
+void my_set_sample_rate(size_t bytes);
+/// Write the live sampled allocations to a file descriptor as a heap profile that pprof reads.
+/// Returns -1 if the write fails, or without profiling.
+int my_heap_profile_dump(int fd);
+
+/// Write the percentiles of the cycles taken by my_malloc and my_free per path, and of the lengths of freelist
+/// lookups (INSTRUMENT=1 builds). Also written at exit to the file named by $MYMALLOC_INSTRUMENT.
+/// Returns -1 if the write fails, or without instrumentation.
+int my_malloc_latency_print(int fd);
@@ -1,37 +1,305 @@
+#define _GNU_SOURCE // mremap
 #include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <stdio.h>
 #include <string.h>
 #include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(ENABLE_THREADS) || defined(ENABLE_TRACE) || defined(ENABLE_PROFILE) || defined(ENABLE_INSTRUMENT)
+#include <pthread.h>
+#endif
+#ifdef ENABLE_TRACE
+#include <fcntl.h>
+#include <stdlib.h>
+#include "trace.h"
+#endif
+#ifdef ENABLE_PROFILE
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#endif
+#ifdef ENABLE_INSTRUMENT
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#endif
 #include "mymalloc.h"
 
+/// A block header. Whether a block is free is kept in the header of its right neighbour, along with
+/// the size of a free block (its footer), so an allocated block only has a 4 byte header: its data
+/// runs over the left_units of its right neighbour. Sizes are stored in units of kAlignment.
 typedef struct Block
 {
-  size_t size : 32;
-  size_t left_size : 31;
-  size_t free : 1;
+  uint32_t left_units;    // Size of the left neighbour if left_free is set, or the end of its data
+  uint32_t units : 31;    // Size of the block
+  uint32_t left_free : 1; // The left neighbour is free, or is a fence
   struct Block *prev;
   struct Block *next;
 } Block;
 
+/// A free block of the general size class, stored as a node of a bitwise trie keyed by block size.
+/// Blocks of equal size hang off a single trie node in a circular prev/next list.
+typedef struct TreeBlock
+{
+  Block block;
+  struct TreeBlock *child[2];
+  struct TreeBlock *parent;
+  size_t bin;                   // Tree bin of a trie node, or N_TREE_BINS for blocks chained to a node
+  bool zeroed;                  // The data past the free block metadata is known to be zero
+  bool purged;                  // The whole pages past the free block metadata were returned to the OS
+  uint64_t free_time;           // Arena clock when the block was freed
+  struct TreeBlock *dirty_prev; // Free blocks whose pages are not purged
+  struct TreeBlock *dirty_next;
+} TreeBlock;
+
+// One tree bin per power of two of the block size
+#define N_TREE_BINS 56
+#define TREE_BIN_SHIFT 8
+
 const size_t kBlockMetadataSize = sizeof(Block);
 const size_t kBlockFixedMetadataSize = offsetof(Block, prev);
-const size_t kChunkSize = 16ull << 20; // 16MB mmap chunk
+const size_t kFooterSize = sizeof(uint32_t); // The left_units of the right neighbour, which is data while a block is allocated
+const size_t kMinChunkSize = 256ull << 10; // Chunks start at 256KB,
+const size_t kMaxChunkSize = 1ull << 30;    // and grow with the heap up to 1GB
 const size_t kFenceSize = sizeof(size_t);
-const size_t kMaxAllocationSize = kChunkSize - kBlockMetadataSize - (kFenceSize << 1); // We support allocation up to ~16MB
+const size_t kMaxBlockAllocationSize = kMaxChunkSize - kBlockMetadataSize - (kFenceSize << 1); // Blocks of a chunk are up to ~1GB
+const size_t kMaxAllocationSize = (SIZE_MAX >> 1) - (1ull << 20);                           // Larger allocations get their own mapping
 
 static const size_t kAlignment = sizeof(size_t); // Word alignment
 static const size_t kMinAllocationSize = kAlignment;
-static const size_t kFenceValue = 0xdeadbeef;
+static const size_t kMinTreeBlockSize = (N_LISTS + 1) * kAlignment + kBlockFixedMetadataSize; // Smallest block of the general size class
+static const size_t kFreeMetadataSize = sizeof(TreeBlock) - kBlockFixedMetadataSize;           // Data bytes used by a free block
+static const size_t kMaxBlockSize = ((1ull << 31) - 1) * kAlignment;                           // Blocks merged across chunks must fit their size field (16GB)
+static const size_t kChunkAlignment = 2ull << 20; // Chunks are aligned to their size, up to 2MB, so they can be backed by huge pages
+static const size_t kMaxSlabChunkSize = kChunkAlignment; // Slab chunks are never unmapped, so they stop growing at one huge page
+#ifdef ENABLE_ALIGN16
+static const size_t kMallocAlignment = 16; // Objects above 8 bytes are aligned for any type, as the x86-64 ABI requires of malloc
+#else
+static const size_t kMallocAlignment = kAlignment;
+#endif
+
+#ifdef ENABLE_PROFILE
+#define PROFILE_MAX_FRAMES 32
+
+/// A sampled allocation, with the call stack that made it
+typedef struct Sample
+{
+  struct Sample *next; // Samples of the same bucket, or records to reuse
+  void *ptr;
+  size_t size; // Requested size
+  size_t n_frames;
+  void *frames[PROFILE_MAX_FRAMES];
+} Sample;
+#endif
+
+/// Header of a huge allocation, which has a dedicated mapping
+typedef struct HugeHeader
+{
+  size_t size;   // Size of the mapping
+  size_t offset; // Distance from the start of the mapping to the data
+} HugeHeader;
+
+static const size_t kPageSize = 4096;
+#ifdef ENABLE_HUGEPAGES
+static const size_t kHugePageSize = 2ull << 20; // Transparent huge pages of x86-64 and arm64
+#endif
+static const size_t kHugeHeaderSize = sizeof(HugeHeader);
+static const size_t kDefaultMmapThreshold = 1ull << 20;
+static const size_t kMaxMmapThreshold = 32ull << 20;
+
+// Allocations above the threshold get a dedicated mapping. Freeing a huge allocation
+// of up to kMaxMmapThreshold bytes raises the threshold to its size, so buffers of that
+// size come from the chunks from then on.
+static size_t mmap_threshold = kDefaultMmapThreshold;
+
+// Whole pages of free blocks of the general size class, and empty slab pages, are returned to
+// the OS once they have been free for the decay period. Arenas check their clock every
+// kPurgeCheckInterval frees and general allocations.
+#ifndef PURGE_DECAY_MS
+#define PURGE_DECAY_MS 10000
+#endif
+
+static const size_t kPurgeCheckInterval = 32;
+#ifdef ENABLE_HUGEPAGES
+// Releasing part of a huge page splits it, so only whole huge pages are purged
+static const size_t kPurgeGranularity = kHugePageSize;
+#else
+static const size_t kPurgeGranularity = kPageSize;
+#endif
+static uint64_t purge_decay = PURGE_DECAY_MS;
+
+// Chunks with no allocated block are unmapped, except for SPARE_CHUNKS of them per arena,
+// so a heap that shrinks and grows again does not map and unmap chunks each time.
+// Chunks grow up to kMaxChunkSize, so the spares are also bounded by SPARE_BYTES.
+#ifndef SPARE_CHUNKS
+#define SPARE_CHUNKS 2
+#endif
+#ifndef SPARE_BYTES
+#define SPARE_BYTES (32 << 20)
+#endif
+
+/// Header of a slab page, which holds objects of a single size class without per-object metadata
+typedef struct SlabPage
+{
+  struct SlabPage *prev;
+  struct SlabPage *next;
+  uint16_t object_size;
+  uint16_t n_objects;
+  uint16_t n_free;
+  uint16_t size_class;
+  uint64_t free_time; // Arena clock when the page was emptied
+  uint64_t bitmap[8]; // Set bits are free slots
+} SlabPage;
+
+#define N_SLAB_CLASSES 13
+
+static const size_t kSlabPageSize = 4096;
+static const size_t kSlabHeaderSize = (sizeof(SlabPage) + 63) & ~(size_t)63; // Objects of multiples of 64 bytes are cache-line aligned
+static const size_t kSlabMaxSize = 256; // Larger requests are served by blocks
+static const uint16_t kSlabClassSizes[N_SLAB_CLASSES] = {8, 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256};
+
+/// An independent heap: its own freelists, slab pages and chunks from the OS
+typedef struct Arena
+{
+  Block *lists[N_LISTS];
+  TreeBlock *trees[N_TREE_BINS]; // General size class, for best-fit lookup
+  uint64_t treemap;              // Bit i is set if trees[i] is not empty
+  void *top;
+  Block *top_block;
+  void *bottom;
+  Block *bottom_block;
+  SlabPage *slabs[N_SLAB_CLASSES]; // Slab pages with free slots
+  SlabPage *free_slabs;            // Empty slab pages, for any size class, newest first
+  SlabPage *free_slabs_oldest;
+  void **purged_slabs;             // Empty slab pages returned to the OS, whose headers read as zero
+  size_t n_purged_slabs;
+  size_t purged_slabs_capacity;
+  size_t slab_cursor;              // Unused pages of the current slab chunk
+  size_t slab_end;
+  TreeBlock *dirty;    // Free blocks of the general size class whose pages are not purged, newest first
+  TreeBlock *dirty_oldest;
+  uint64_t clock;      // Coarse time in ms, for purge decay
+  uint64_t next_purge; // Clock of the next purge pass
+  size_t ticks;        // Operations since the last clock update
+  size_t free_chunks;  // Block chunks without allocated blocks
+  size_t free_chunk_bytes;
+  size_t mapped;       // Bytes of chunks, which sets the size of the next one
+  size_t chunks;       // Number of chunks
+  size_t live;         // Bytes of allocated blocks and slab objects
+  size_t free_bytes[N_LISTS + 1]; // Bytes of the free blocks of each list, then of the trees
+#ifdef ENABLE_THREADS
+  pthread_mutex_t lock;
+  size_t nthreads;    // Number of threads assigned to this arena
+  void *remote_frees; // Objects freed by threads of other arenas
+#endif
+} Arena;
+
+#ifdef ENABLE_THREADS
+#define MAX_ARENAS 64
+#else
+#define MAX_ARENAS 1
+#endif
+
+static Arena arenas[MAX_ARENAS];
+
+/// What a chunk is used for
+typedef enum ChunkKind
+{
+  kBlockChunk = 0,
+  kSlabChunk = 1,
+  kHugeChunk = 2, // Holds the data pointer of a huge allocation, has no arena
+} ChunkKind;
+
+static const size_t kChunkKindMask = 3;
+
+/// Chunk map entry of a kMinChunkSize granule
+typedef struct ChunkInfo
+{
+  size_t entry; // Owning arena tagged with the ChunkKind
+  size_t start; // Chunk holding the granule
+  size_t size;  // Size of the chunk
+  size_t live;  // Bytes of allocated blocks in a block chunk, kept in the entry of its first granule
+} ChunkInfo;
+
+// Chunks are made of whole kMinChunkSize-aligned granules, so the chunk map can find the owner
+// of any object. The map is a two-level table indexed by the granule number of an address.
+// Each granule of a chunk has an entry. Huge mappings are not aligned, but chunks never share
+// their granules, so the entry of the granule holding a huge data pointer is left as kHugeChunk
+// until a chunk is mapped there.
+#define CHUNK_SHIFT 18
+#define ADDRESS_BITS (sizeof(void *) == 8 ? 48 : 32)
+#define CHUNK_MAP_LEAF_BITS ((ADDRESS_BITS - CHUNK_SHIFT) >> 1)
+#define CHUNK_MAP_ROOT_BITS (ADDRESS_BITS - CHUNK_SHIFT - CHUNK_MAP_LEAF_BITS)
+
+static ChunkInfo *chunk_map[1ull << CHUNK_MAP_ROOT_BITS];
+
+/// Event counters of my_malloc_stats
+typedef struct Counters
+{
+  size_t mallocs;
+  size_t frees;
+  size_t reallocs;
+  size_t splits;
+  size_t coalesces;
+  size_t mmaps; // Calls to mmap and mremap
+  size_t munmaps;
+} Counters;
+
+// Bytes and number of the dedicated mappings of huge allocations
+static size_t huge_mapped = 0;
+static size_t huge_count = 0;
+
+#ifdef ENABLE_THREADS
+static const size_t kTCacheBatchSize = 16; // Blocks moved per refill / flush
+static const size_t kTCacheMaxCount = 64;  // Flush a bin once it grows beyond this
 
-static Block *lists[N_LISTS + 1];
+// Bins of the thread cache: one per slab class, then one per small block size class
+#define N_TCACHE_BINS (N_SLAB_CLASSES + N_LISTS)
 
-static void *top = NULL;
-static Block *top_block = NULL;
+/// Per-thread cache of objects for the slab and small block size classes, linked by their first word.
+/// Cached objects stay allocated as far as their arena is concerned, so blocks are never coalesced.
+typedef struct TCache
+{
+  void *bins[N_TCACHE_BINS];
+  size_t counts[N_TCACHE_BINS];
+  Arena *arena; // Arena this thread allocates from
+  bool registered;
+  bool registering; // Allocations made while registering are served without the cache
+  Counters counters;
+  struct TCache *prev; // Registered caches, whose counters my_malloc_stats sums
+  struct TCache *next;
+} TCache;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static size_t n_arenas = 1;
+static __thread TCache tcache;
+
+// Counters are sharded per thread: a thread only bumps the counters of its own cache, which
+// my_malloc_stats sums. Counters of exited threads, and of threads without a cache, are retired.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static TCache *registered_caches = NULL;
+static Counters retired_counters;
+
+#define COUNT_N(name, n)                                                                    \
+  do                                                                                        \
+  {                                                                                         \
+    if (tcache.registered)                                                                  \
+      __atomic_store_n(&tcache.counters.name, tcache.counters.name + (n), __ATOMIC_RELAXED); \
+    else                                                                                    \
+      __atomic_fetch_add(&retired_counters.name, (n), __ATOMIC_RELAXED);                   \
+  } while (0)
+#else
+static Counters counters;
 
-static void *bottom = NULL;
-static Block *bottom_block = NULL;
+#define COUNT_N(name, n) (counters.name += (n))
+#endif
+#define COUNT(name) COUNT_N(name, 1)
 
 inline static size_t max(size_t a, size_t b)
 {
@@ -46,16 +314,306 @@ inline static size_t size_class(size_t size)
   return sc >= N_LISTS ? N_LISTS : sc;
 }
 
+/// Get slab size class
+inline static size_t slab_class(size_t size)
+{
+  assert(size >= kAlignment && size <= kSlabMaxSize);
+  if (size <= 8)
+    return 0;
+  if (size <= 128)
+    return (size + 15) >> 4;
+  return 8 + ((size - 128 + 31) >> 5);
+}
+
+/// Index of the most significant set bit
+inline static size_t find_last_set(size_t x)
+{
+  assert(x != 0);
+  return (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(x);
+}
+
+/// Get the tree bin of a general block size
+inline static size_t tree_bin(size_t size)
+{
+  size_t bin = find_last_set(size) - TREE_BIN_SHIFT;
+  assert(bin < N_TREE_BINS);
+  return bin;
+}
+
+#ifdef ENABLE_INSTRUMENT
+// Each thread records the cycles of its my_malloc and my_free calls, and the lengths of its freelist
+// lookups, into log-bucketed histograms that my_malloc_latency_print sums.
+
+/// Paths through my_malloc and my_free, from the fastest. A call counts towards the slowest path it takes.
+typedef enum InstrumentPath
+{
+  kMallocTCache,
+  kMallocSlab,
+  kMallocList,
+  kMallocLargerList, // A list of a larger size class, found by searching upwards
+  kMallocTree,
+  kMallocChunk, // A new chunk was mapped
+  kMallocHuge,
+  kFreeTCache,
+  kFreeRemote,
+  kFreeSlab,
+  kFreeBlock,
+  kFreeFlush,   // The thread cache was flushed to the arena
+  kFreeRelease, // A chunk was returned to the OS
+  kFreeHuge,
+  N_PATHS,
+} InstrumentPath;
+
+// Histograms of lookup lengths follow the latency histograms of the paths
+#define HISTOGRAM_TREE_NODES N_PATHS           // Tree nodes visited by a best-fit lookup
+#define HISTOGRAM_CLASSES_SKIPPED (N_PATHS + 1) // Empty size classes skipped before a list is found
+#define N_HISTOGRAMS (N_PATHS + 2)
+
+// Values below 4 have their own buckets, then each power of two is split into 4 buckets
+#define N_BUCKETS 160
+
+typedef struct Histogram
+{
+  uint64_t counts[N_BUCKETS];
+  uint64_t max;
+} Histogram;
+
+typedef struct Instrument
+{
+  Histogram histograms[N_HISTOGRAMS];
+  InstrumentPath path;    // Slowest path of the current call
+  size_t classes_skipped; // By the current size class lookup
+  bool registered;
+  bool registering;
+  struct Instrument *prev; // Histograms of running threads, which my_malloc_latency_print sums
+  struct Instrument *next;
+} Instrument;
+
+/// A call being timed
+typedef struct InstrumentCall
+{
+  uint64_t start;
+  InstrumentPath outer_path; // Path of the call this one is nested in, if the C library allocates
+} InstrumentCall;
+
+static pthread_mutex_t instrument_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t instrument_once = PTHREAD_ONCE_INIT;
+static pthread_key_t instrument_key;
+static Instrument *registered_instruments = NULL;
+static Histogram retired_histograms[N_HISTOGRAMS]; // Of exited threads
+static __thread Instrument instrument;
+
+/// Read the time stamp counter. Other architectures count nanoseconds instead.
+inline static uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/// Get the histogram bucket of a value
+inline static size_t histogram_bucket(uint64_t value)
+{
+  if (value < 4)
+    return value;
+  size_t e = find_last_set(value);
+  size_t bucket = ((e - 1) << 2) + ((value >> (e - 2)) & 3);
+  return bucket < N_BUCKETS ? bucket : N_BUCKETS - 1;
+}
+
+/// Get the largest value of a histogram bucket
+static uint64_t histogram_bucket_limit(size_t bucket)
+{
+  if (bucket < 4)
+    return bucket;
+  size_t e = (bucket >> 2) + 1;
+  return ((4 + (bucket & 3) + 1) << (e - 2)) - 1;
+}
+
+/// Move the histograms of a thread to the retired histograms, and unregister it. instrument_lock must be held.
+static void retire_histograms(Instrument *state)
+{
+  for (size_t h = 0; h < N_HISTOGRAMS; h++)
+  {
+    for (size_t b = 0; b < N_BUCKETS; b++)
+      retired_histograms[h].counts[b] += state->histograms[h].counts[b];
+    retired_histograms[h].max = max(retired_histograms[h].max, state->histograms[h].max);
+  }
+  memset(state->histograms, 0, sizeof(state->histograms));
+  if (state->prev != NULL)
+    state->prev->next = state->next;
+  else
+    registered_instruments = state->next;
+  if (state->next != NULL)
+    state->next->prev = state->prev;
+  state->prev = NULL;
+  state->next = NULL;
+}
+
+static void instrument_thread_exit(void *arg)
+{
+  Instrument *state = arg;
+  pthread_mutex_lock(&instrument_lock);
+  retire_histograms(state);
+  state->registered = false;
+  pthread_mutex_unlock(&instrument_lock);
+}
+
+static void instrument_fork_prepare(void)
+{
+  pthread_mutex_lock(&instrument_lock);
+}
+
+static void instrument_fork_parent(void)
+{
+  pthread_mutex_unlock(&instrument_lock);
+}
+
+/// Only the forking thread survives in the child
+static void instrument_fork_child(void)
+{
+  for (Instrument *state = registered_instruments, *next; state != NULL; state = next)
+  {
+    next = state->next;
+    if (state != &instrument)
+      retire_histograms(state);
+  }
+  pthread_mutex_unlock(&instrument_lock);
+}
+
+static void instrument_init(void)
+{
+  pthread_key_create(&instrument_key, instrument_thread_exit);
+  pthread_atfork(instrument_fork_prepare, instrument_fork_parent, instrument_fork_child);
+}
+
+/// Register the histograms of the current thread, so they are summed and retired on thread exit
+static void instrument_register(void)
+{
+  // The C library may allocate while we register, which comes back here
+  if (instrument.registering)
+    return;
+  instrument.registering = true;
+  pthread_once(&instrument_once, instrument_init);
+  pthread_mutex_lock(&instrument_lock);
+  instrument.next = registered_instruments;
+  if (instrument.next != NULL)
+    instrument.next->prev = &instrument;
+  registered_instruments = &instrument;
+  instrument.registered = true;
+  pthread_mutex_unlock(&instrument_lock);
+  pthread_setspecific(instrument_key, &instrument);
+  instrument.registering = false;
+}
+
+/// Add a value to a histogram of the current thread, which other threads may be summing
+static void histogram_record(size_t histogram, uint64_t value)
+{
+  if (!instrument.registered)
+    instrument_register();
+  Histogram *h = &instrument.histograms[histogram];
+  size_t bucket = histogram_bucket(value);
+  __atomic_store_n(&h->counts[bucket], h->counts[bucket] + 1, __ATOMIC_RELAXED);
+  if (value > h->max)
+    __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+/// Start timing a call, which takes the path `fastest` unless a slower path is recorded
+inline static InstrumentCall instrument_begin(InstrumentPath fastest)
+{
+  InstrumentCall call = {.outer_path = instrument.path};
+  instrument.path = fastest;
+  call.start = read_cycles();
+  return call;
+}
+
+inline static void instrument_end(InstrumentCall *call)
+{
+  uint64_t cycles = read_cycles() - call->start;
+  InstrumentPath path = instrument.path;
+  instrument.path = call->outer_path;
+  histogram_record(path, cycles);
+}
+
+/// Record that the current call takes a path. Paths of the other kind of call are ignored, like
+/// the frees of remote objects drained by an allocation.
+inline static void instrument_path(InstrumentPath path)
+{
+  if (path > instrument.path && (path >= kFreeTCache) == (instrument.path >= kFreeTCache))
+    instrument.path = path;
+}
+
+/// Record the end of a size class lookup, which found a list or reached the general size class
+static void instrument_lookup(InstrumentPath path)
+{
+  histogram_record(HISTOGRAM_CLASSES_SKIPPED, instrument.classes_skipped);
+  instrument_path(path == kMallocList && instrument.classes_skipped != 0 ? kMallocLargerList : path);
+  instrument.classes_skipped = 0;
+}
+
+#define INSTRUMENT_BEGIN(fastest) InstrumentCall instrument_call = instrument_begin(fastest)
+#define INSTRUMENT_END() instrument_end(&instrument_call)
+#define INSTRUMENT_PATH(path) instrument_path(path)
+#define INSTRUMENT_LOOKUP(path) instrument_lookup(path)
+#define INSTRUMENT_SKIP() (instrument.classes_skipped += 1)
+#define INSTRUMENT_SEARCH(nodes) histogram_record(HISTOGRAM_TREE_NODES, nodes)
+#else
+#define INSTRUMENT_BEGIN(fastest)
+#define INSTRUMENT_END()
+#define INSTRUMENT_PATH(path) ((void)0)
+#define INSTRUMENT_LOOKUP(path) ((void)0)
+#define INSTRUMENT_SKIP() ((void)0)
+#define INSTRUMENT_SEARCH(nodes) ((void)0)
+#endif
+
+/// Get the size of a block
+inline static size_t get_block_size(Block *block)
+{
+  return ((size_t)block->units) * kAlignment;
+}
+
+/// Set the size of a block, a multiple of kMallocAlignment
+inline static void set_block_size(Block *block, size_t size)
+{
+  assert(size % kMallocAlignment == 0 && size <= kMaxBlockSize);
+  block->units = size / kAlignment;
+}
+
 /// Get right neighbour
 inline static Block *get_right_block(Block *block)
 {
-  return (Block *)(((size_t)block) + block->size);
+  return (Block *)(((size_t)block) + get_block_size(block));
 }
 
-/// Get left neighbour
+/// Get left neighbour, which is only known if it is free or a fence
 inline static Block *get_left_block(Block *block)
 {
-  return (Block *)(((size_t)block) - block->left_size);
+  assert(block->left_free);
+  return (Block *)(((size_t)block) - ((size_t)block->left_units) * kAlignment);
+}
+
+/// Check if a block is free, which its right neighbour records
+inline static bool is_free(Block *block)
+{
+  return get_right_block(block)->left_free;
+}
+
+/// Mark a block free, and write its size in its footer. Also called when a free block changes size.
+inline static void set_free(Block *block)
+{
+  Block *right = get_right_block(block);
+  right->left_units = block->units;
+  right->left_free = true;
+}
+
+/// Mark a block allocated. Its footer is now part of its data, so it is left alone.
+inline static void set_allocated(Block *block)
+{
+  get_right_block(block)->left_free = false;
 }
 
 /// Round up size
@@ -77,257 +635,2977 @@ inline static Block *data_to_block(void *ptr)
   return (Block *)(((size_t)ptr) - kBlockFixedMetadataSize);
 }
 
-/// Add block to the freelist
-static void add_block(Block *block)
+/// Get the usable size of an allocated block, which includes its footer
+inline static size_t block_usable_size(Block *block)
 {
-  assert(block->size >= kBlockMetadataSize);
-  size_t sc = size_class(block->size - kBlockFixedMetadataSize);
-  block->prev = NULL;
-  block->next = lists[sc];
-  if (lists[sc] != NULL)
-    lists[sc]->prev = block;
-  lists[sc] = block;
+  return get_block_size(block) - kBlockFixedMetadataSize + kFooterSize;
 }
 
-/// Remove block from the freelist
-static void remove_block(Block *block)
+/// Round up the size of an allocation made from a block to the size the freelists hold it with.
+/// The block holds kFooterSize bytes more, in its footer. Block sizes are multiples of kMallocAlignment,
+/// so the data of every block is aligned to it.
+inline static size_t block_alloc_size(size_t size)
 {
-  assert(block->size >= kBlockMetadataSize);
-  size_t sc = size_class(block->size - kBlockFixedMetadataSize);
-  if (block->prev != NULL)
-    block->prev->next = block->next;
-  if (block->next != NULL)
-    block->next->prev = block->prev;
-  if (lists[sc] == block)
+  // Blocks never get as small as slab objects
+  size = max(size, kSlabMaxSize + kAlignment + kFooterSize);
+  return size_align_up(size - kFooterSize + kBlockFixedMetadataSize, kMallocAlignment) - kBlockFixedMetadataSize;
+}
+
+/// Get the chunk map slot of an address
+inline static ChunkInfo *chunk_map_slot(void *ptr, bool create)
+{
+  size_t index = ((size_t)ptr) >> CHUNK_SHIFT;
+  size_t root = index >> CHUNK_MAP_LEAF_BITS;
+  size_t leaf = index & ((1ull << CHUNK_MAP_LEAF_BITS) - 1);
+  assert(root < (1ull << CHUNK_MAP_ROOT_BITS));
+  ChunkInfo *leaves = __atomic_load_n(&chunk_map[root], __ATOMIC_ACQUIRE);
+  if (leaves == NULL)
   {
-    lists[sc] = block->next;
-    if (lists[sc] != NULL)
-      lists[sc]->prev = NULL;
+    if (!create)
+      return NULL;
+    const size_t size = sizeof(ChunkInfo) << CHUNK_MAP_LEAF_BITS;
+    ChunkInfo *fresh = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(fresh != MAP_FAILED);
+    if (__atomic_compare_exchange_n(&chunk_map[root], &leaves, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      leaves = fresh;
+    else
+      munmap(fresh, size);
   }
-  block->next = NULL;
-  block->prev = NULL;
+  return &leaves[leaf];
 }
 
-/// Check if we're touching a fence
-inline static bool is_fence(Block *block)
+/// Record the owner and size of a chunk in the entries of its granules
+static void register_chunk(void *chunk, size_t size, Arena *arena, ChunkKind kind)
 {
-  return *((size_t *)block) == kFenceValue;
+  for (size_t offset = 0; offset < size; offset += kMinChunkSize)
+  {
+    ChunkInfo *info = chunk_map_slot((void *)(((size_t)chunk) + offset), true);
+    info->entry = ((size_t)arena) | kind;
+    info->start = (size_t)chunk;
+    info->size = size;
+  }
 }
 
-/// Acquire more memory from OS
-static Block *acquire_more_memory(size_t alloc_size)
+/// Get the entry of the first granule of the chunk holding an address
+inline static ChunkInfo *chunk_head(void *ptr)
 {
-  assert(alloc_size + kBlockMetadataSize + (kFenceSize << 1) <= kChunkSize);
-  // Acquire one more chunk from OS
-  size_t *ptr = mmap(NULL, kChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-  assert(ptr != MAP_FAILED);
-  // Mark fences
-  *ptr = kFenceValue;
-  *((size_t *)(((size_t)ptr) + kChunkSize - kFenceSize)) = kFenceValue;
-  // Initialize block metadata
-  Block *block = (Block *)(ptr + 1);
-  block->free = false;
-  block->size = kChunkSize - (kFenceSize << 1);
-  block->left_size = kFenceSize;
-  block->prev = NULL;
-  block->next = NULL;
-  void *end = (void *)(((size_t)ptr) + kChunkSize);
-  // Try merge bottom chunks
-  if (bottom != NULL && bottom == end)
+  return chunk_map_slot((void *)chunk_map_slot(ptr, false)->start, false);
+}
+
+/// Get the chunk map entry of an object
+inline static size_t chunk_entry(void *ptr)
+{
+  ChunkInfo *slot = chunk_map_slot(ptr, false);
+  assert(slot != NULL && slot->entry != 0);
+  return slot->entry;
+}
+
+inline static Arena *entry_arena(size_t entry)
+{
+  return (Arena *)(entry & ~kChunkKindMask);
+}
+
+inline static ChunkKind entry_kind(size_t entry)
+{
+  return (ChunkKind)(entry & kChunkKindMask);
+}
+
+/// Insert a block into the trie of its tree bin
+static void tree_insert(Arena *arena, TreeBlock *node)
+{
+  size_t size = get_block_size(&node->block);
+  size_t bin = tree_bin(size);
+  node->child[0] = node->child[1] = NULL;
+  node->block.prev = node->block.next = &node->block;
+  if (arena->trees[bin] == NULL)
   {
-    // Merge chunks
-    assert(is_fence(get_left_block(bottom_block)));
-    if (bottom_block->free)
+    arena->trees[bin] = node;
+    arena->treemap |= 1ull << bin;
+    node->parent = NULL;
+    node->bin = bin;
+    return;
+  }
+  // Walk down the trie, branching on the size bits below the leading bit
+  TreeBlock *t = arena->trees[bin];
+  for (size_t bit = TREE_BIN_SHIFT + bin - 1;; bit--)
+  {
+    if (get_block_size(&t->block) == size)
     {
-      remove_block(bottom_block);
-      block->size = bottom_block->size + kChunkSize;
-      Block *right = get_right_block(bottom_block);
-      right->left_size = block->size;
+      // Chain to the node of the same size
+      Block *next = t->block.next;
+      node->block.prev = &t->block;
+      node->block.next = next;
+      next->prev = &node->block;
+      t->block.next = &node->block;
+      node->parent = NULL;
+      node->bin = N_TREE_BINS;
+      return;
     }
-    else
+    TreeBlock **child = &t->child[(size >> bit) & 1];
+    if (*child == NULL)
     {
-      block->size = kChunkSize;
-      bottom_block->left_size = kChunkSize;
+      *child = node;
+      node->parent = t;
+      node->bin = bin;
+      return;
     }
+    t = *child;
   }
-  // Update bottom cursor
-  if (bottom == NULL || (size_t)ptr < (size_t)bottom)
+}
+
+/// Remove a block from the trie of its tree bin
+static void tree_remove(Arena *arena, TreeBlock *node)
+{
+  if (node->bin == N_TREE_BINS)
   {
-    bottom = (void *)ptr;
-    bottom_block = block;
+    // Chained block: just unlink it
+    node->block.prev->next = node->block.next;
+    node->block.next->prev = node->block.prev;
+    return;
   }
-  // Try merge top chunks
-  if (top != NULL && top == ptr)
+  TreeBlock *replacement;
+  if (node->block.next != &node->block)
   {
-    // Merge chunks
-    Block *right = get_right_block(top_block);
-    assert(is_fence(right));
-    if (top_block->free)
+    // The next block of the same size takes over the trie node
+    replacement = (TreeBlock *)node->block.next;
+    node->block.prev->next = node->block.next;
+    node->block.next->prev = node->block.prev;
+  }
+  else
+  {
+    // A leaf of the subtree takes over the trie node
+    TreeBlock **slot = NULL;
+    replacement = NULL;
+    if (node->child[1] != NULL || node->child[0] != NULL)
     {
-      remove_block(top_block);
-      top_block->free = false;
-      top_block->size += kChunkSize;
-      top_block->prev = NULL;
-      top_block->next = NULL;
-      block = top_block;
+      slot = node->child[1] != NULL ? &node->child[1] : &node->child[0];
+      replacement = *slot;
+      while (replacement->child[1] != NULL || replacement->child[0] != NULL)
+      {
+        slot = replacement->child[1] != NULL ? &replacement->child[1] : &replacement->child[0];
+        replacement = *slot;
+      }
+      *slot = NULL;
     }
-    else
+  }
+  if (replacement != NULL)
+  {
+    replacement->parent = node->parent;
+    replacement->bin = node->bin;
+    for (size_t i = 0; i < 2; i++)
     {
-      right->free = false;
-      right->size = kChunkSize;
-      right->left_size = top_block->size;
-      right->prev = NULL;
-      right->next = NULL;
-      block = right;
+      replacement->child[i] = node->child[i];
+      if (replacement->child[i] != NULL)
+        replacement->child[i]->parent = replacement;
     }
   }
-  // Update top cursor
-  if ((size_t)ptr > (size_t)top)
+  if (node->parent == NULL)
   {
-    top = (void *)(((size_t)ptr) + kChunkSize);
-    top_block = block;
+    arena->trees[node->bin] = replacement;
+    if (replacement == NULL)
+      arena->treemap &= ~(1ull << node->bin);
+  }
+  else
+  {
+    TreeBlock *parent = node->parent;
+    parent->child[parent->child[0] == node ? 0 : 1] = replacement;
   }
-  return block;
 }
 
-/// Split a block into two
-static Block *split(Block *block, size_t size)
+/// Find the smallest free block of at least `size` bytes in the tree bins
+static TreeBlock *tree_best_fit(Arena *arena, size_t size)
+{
+  TreeBlock *best = NULL;
+  size_t bin = tree_bin(size);
+  TreeBlock *t = arena->trees[bin];
+  size_t visited = 0; // Only counted by INSTRUMENT builds
+  USE(visited);
+  if (t != NULL)
+  {
+    // Follow the path of `size`, remembering the last right subtree we did not take
+    TreeBlock *right_subtree = NULL;
+    for (size_t bit = TREE_BIN_SHIFT + bin - 1; t != NULL; bit--)
+    {
+      visited += 1;
+      if (get_block_size(&t->block) >= size && (best == NULL || get_block_size(&t->block) < get_block_size(&best->block)))
+      {
+        best = t;
+        if (get_block_size(&t->block) == size)
+        {
+          INSTRUMENT_SEARCH(visited);
+          return best;
+        }
+      }
+      TreeBlock *right = t->child[1];
+      t = t->child[(size >> bit) & 1];
+      if (right != NULL && right != t)
+        right_subtree = right;
+    }
+    // Every block of the untaken right subtree is larger than `size`
+    t = right_subtree;
+  }
+  if (t == NULL && best == NULL)
+  {
+    // Take the smallest block of the next non-empty bin
+    uint64_t larger = bin + 1 < N_TREE_BINS ? arena->treemap & (~0ull << (bin + 1)) : 0;
+    if (larger != 0)
+      t = arena->trees[__builtin_ctzll(larger)];
+  }
+  // Find the smallest block of the subtree
+  for (; t != NULL; t = t->child[0] != NULL ? t->child[0] : t->child[1])
+  {
+    visited += 1;
+    if (get_block_size(&t->block) >= size && (best == NULL || get_block_size(&t->block) < get_block_size(&best->block)))
+      best = t;
+  }
+  INSTRUMENT_SEARCH(visited);
+  return best;
+}
+
+/// Check if a block is large enough to be a TreeBlock when free, which tracks the state of its pages
+inline static bool is_tree_block(Block *block)
 {
+  return size_class(get_block_size(block) - kBlockFixedMetadataSize) == N_LISTS;
+}
 
-  // Split block
-  size_t total_size = block->size;
-  Block *first = block;
-  first->free = true;
-  first->size = total_size - max(size + kBlockFixedMetadataSize, kBlockMetadataSize);
-  assert(first->size >= kMinAllocationSize);
-  Block *second = get_right_block(first);
-  second->size = total_size - first->size;
-  second->left_size = first->size;
-  second->free = false;
-  second->prev = NULL;
-  second->next = NULL;
-  assert(first != second);
-  // Update the right neighbour of the second block
-  Block *right = get_right_block(second);
-  if (!is_fence(right))
-    right->left_size = second->size;
-  // Update top block
-  if (block == top_block)
-    top_block = second;
-  return second;
+/// Check if a free block is known to be zero past its metadata. Only the general size class keeps track.
+inline static bool is_zeroed(Block *block)
+{
+  return is_tree_block(block) && ((TreeBlock *)block)->zeroed;
+}
+
+/// Record whether a free block is known to be zero past its metadata
+inline static void set_zeroed(Block *block, bool zeroed)
+{
+  if (is_tree_block(block))
+    ((TreeBlock *)block)->zeroed = zeroed;
 }
 
-/// Try allocate from the last general freelist
-static Block *alloc_from_general_list(size_t alloc_size)
+/// Check if the pages of a free block were returned to the OS
+inline static bool is_purged(Block *block)
 {
-  Block *block = NULL;
-  for (Block *b = lists[N_LISTS]; b != NULL; b = b->next)
+  return is_tree_block(block) && ((TreeBlock *)block)->purged;
+}
+
+/// Record the state of the pages of a free block before it is added to the freelists
+inline static void set_free_state(Block *block, bool zeroed, bool purged, uint64_t free_time)
+{
+  if (is_tree_block(block))
   {
-    if (b->size - kBlockFixedMetadataSize >= alloc_size)
-    {
-      block = b;
-      remove_block(block);
-      break;
-    }
+    TreeBlock *node = (TreeBlock *)block;
+    node->zeroed = zeroed;
+    node->purged = purged;
+    node->free_time = free_time;
   }
-  if (block == NULL)
-    block = acquire_more_memory(alloc_size);
-  assert(block != NULL);
-  block->free = false;
-  block->next = NULL;
-  block->prev = NULL;
-  assert(block->size >= alloc_size + kBlockFixedMetadataSize);
-  return block;
 }
 
-/// Allocate from one of the freelists
-static Block *alloc_with_size_class(size_t sc, size_t alloc_size)
+/// Add a free block to the dirty list, which is ordered by free time. A block linked back with an older
+/// free time, such as the remainder of a split, counts as freed along with the newest one.
+static void dirty_push(Arena *arena, TreeBlock *node)
 {
-  if (lists[sc] != NULL && sc < N_LISTS)
+  node->dirty_prev = NULL;
+  node->dirty_next = arena->dirty;
+  if (arena->dirty != NULL)
   {
-    // Current list is not empty
-    Block *block = lists[sc];
-    lists[sc] = lists[sc]->next;
-    if (lists[sc] != NULL)
-      lists[sc]->prev = NULL;
-    block->free = false;
-    block->next = NULL;
-    block->prev = NULL;
-    assert(block->size >= alloc_size + kBlockFixedMetadataSize);
-    return block;
+    node->free_time = max(node->free_time, arena->dirty->free_time);
+    arena->dirty->dirty_prev = node;
   }
   else
   {
-    Block *block = sc < N_LISTS ? alloc_with_size_class(sc + 1, alloc_size) : alloc_from_general_list(alloc_size);
-    if (block->size >= alloc_size + (kBlockMetadataSize << 1) + kMinAllocationSize)
-    {
-      Block *second = split(block, alloc_size);
-      Block *first = block;
-      add_block(first);
-      block = second;
-      assert(block->size >= alloc_size + kBlockFixedMetadataSize);
-    }
-    assert(block->size >= alloc_size + kBlockFixedMetadataSize);
-    assert(!block->free);
-    return block;
+    arena->dirty_oldest = node;
   }
+  arena->dirty = node;
 }
 
-void *my_malloc(size_t size)
+/// Remove a free block from the dirty list
+static void dirty_unlink(Arena *arena, TreeBlock *node)
 {
-  // Round up allocation size
-  size = size_align_up(size, kAlignment);
-  if (size == 0 || size > kMaxAllocationSize)
-    return NULL;
-  size_t sc = size_class(size);
-  // Try pop a block from list
-  Block *block = alloc_with_size_class(sc, size);
-  // Zero memory and return
-  void *data = block_to_data(block);
-  assert(block->size >= size + kBlockFixedMetadataSize);
-  memset(data, 0, size);
-  LOG("alloc %p size=%zu block=%p\n", data, size, (void *)block);
-  return data;
+  if (node->dirty_prev != NULL)
+    node->dirty_prev->dirty_next = node->dirty_next;
+  else
+    arena->dirty = node->dirty_next;
+  if (node->dirty_next != NULL)
+    node->dirty_next->dirty_prev = node->dirty_prev;
+  else
+    arena->dirty_oldest = node->dirty_prev;
 }
 
-/// Coalesce two neighbour blocks
-static void coalesce_blocks(Block *left, Block *right)
+/// Count `size` bytes from `start` as allocated (`live`) or free in the chunks they cover
+static void account_live(Arena *arena, void *start, size_t size, bool live)
 {
-  assert(right == get_right_block(left));
-  // Remove left from the list
-  remove_block(left);
-  // Remove right from the list
-  remove_block(right);
-  // Merge left and right
-  left->size += right->size;
-  // Update right.right block
-  Block *right_right = get_right_block(right);
-  if (!is_fence(right_right))
-    right_right->left_size = left->size;
-  // Add left back to list
-  add_block(left);
-  // Update top block
-  if (right == top_block)
-    top_block = left;
+  size_t end = ((size_t)start) + size;
+  if (live)
+    arena->live += size;
+  else
+    arena->live -= size;
+  for (size_t addr = (size_t)start; addr < end;)
+  {
+    ChunkInfo *info = chunk_head((void *)addr);
+    size_t chunk_end = info->start + info->size;
+    size_t bytes = (chunk_end < end ? chunk_end : end) - addr;
+    if (live)
+    {
+      if (info->live == 0)
+      {
+        arena->free_chunks -= 1;
+        arena->free_chunk_bytes -= info->size;
+      }
+      info->live += bytes;
+    }
+    else
+    {
+      assert(info->live >= bytes);
+      info->live -= bytes;
+      if (info->live == 0)
+      {
+        arena->free_chunks += 1;
+        arena->free_chunk_bytes += info->size;
+      }
+    }
+    addr = chunk_end;
+  }
 }
 
-void my_free(void *ptr)
+/// Add block to the freelist, without accounting
+static void link_block(Arena *arena, Block *block)
 {
-  if (ptr == NULL)
+  assert(get_block_size(block) >= kBlockMetadataSize);
+  size_t sc = size_class(get_block_size(block) - kBlockFixedMetadataSize);
+  arena->free_bytes[sc] += get_block_size(block);
+  if (sc == N_LISTS)
+  {
+    tree_insert(arena, (TreeBlock *)block);
+    if (!((TreeBlock *)block)->purged)
+      dirty_push(arena, (TreeBlock *)block);
     return;
-  Block *block = data_to_block(ptr);
-  LOG("free %p size=%zu block=%p\n", ptr, block->size - kBlockFixedMetadataSize, (void *)block);
-  assert(!block->free);
-  block->free = true;
-  // Add block to freelist
-  add_block(block);
-  // Try coalescing
+  }
+  block->prev = NULL;
+  block->next = arena->lists[sc];
+  if (arena->lists[sc] != NULL)
+    arena->lists[sc]->prev = block;
+  arena->lists[sc] = block;
+}
+
+/// Remove block from the freelist, without accounting
+static void unlink_block(Arena *arena, Block *block)
+{
+  assert(get_block_size(block) >= kBlockMetadataSize);
+  size_t sc = size_class(get_block_size(block) - kBlockFixedMetadataSize);
+  arena->free_bytes[sc] -= get_block_size(block);
+  if (sc == N_LISTS)
+  {
+    tree_remove(arena, (TreeBlock *)block);
+    if (!((TreeBlock *)block)->purged)
+      dirty_unlink(arena, (TreeBlock *)block);
+    block->next = NULL;
+    block->prev = NULL;
+    return;
+  }
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+  if (arena->lists[sc] == block)
+  {
+    arena->lists[sc] = block->next;
+    if (arena->lists[sc] != NULL)
+      arena->lists[sc]->prev = NULL;
+  }
+  block->next = NULL;
+  block->prev = NULL;
+}
+
+/// Add block to the freelist
+static void add_block(Arena *arena, Block *block)
+{
+  link_block(arena, block);
+  account_live(arena, block, get_block_size(block), false);
+}
+
+/// Remove block from the freelist
+static void remove_block(Arena *arena, Block *block)
+{
+  account_live(arena, block, get_block_size(block), true);
+  unlink_block(arena, block);
+}
+
+/// Check if we're touching a fence, a header of size 0 at either end of a chunk
+inline static bool is_fence(Block *block)
+{
+  return block->units == 0;
+}
+
+/// Turn a header into a fence, which keeps what it knows of its left neighbour
+inline static void set_fence(Block *fence)
+{
+  fence->units = 0;
+}
+
+/// Get the monotonic time in ms
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000 + ((uint64_t)ts.tv_nsec) / 1000000;
+}
+
+/// Return the whole pages (of kPurgeGranularity) of a free block past its metadata to the OS
+static void purge_block(Arena *arena, TreeBlock *node)
+{
+  dirty_unlink(arena, node);
+  node->purged = true;
+  size_t data = ((size_t)node) + sizeof(TreeBlock);
+  size_t end = ((size_t)node) + get_block_size(&node->block);
+  size_t first = size_align_up(data, kPurgeGranularity);
+  size_t last = end & ~(kPurgeGranularity - 1);
+  if (first >= last)
+    return;
+  madvise((void *)first, last - first, MADV_DONTNEED);
+  // Purged pages read as zero, so clearing the partial pages around them makes the block zero.
+  // Partial huge pages are too large to be worth clearing.
+  if (!node->zeroed && kPurgeGranularity == kPageSize)
+  {
+    memset((void *)data, 0, first - data);
+    memset((void *)last, 0, end - last);
+    node->zeroed = true;
+  }
+}
+
+/// Return the oldest empty slab page to the OS. Its header reads as zero from then on, so the page
+/// is kept on the stack of purged slab pages. Returns false if the stack cannot grow.
+static bool purge_slab(Arena *arena)
+{
+  if (arena->n_purged_slabs == arena->purged_slabs_capacity)
+  {
+    size_t capacity = arena->purged_slabs_capacity == 0 ? kPageSize / sizeof(void *) : arena->purged_slabs_capacity << 1;
+    void **grown = mmap(NULL, capacity * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (grown == MAP_FAILED)
+      return false;
+    if (arena->purged_slabs != NULL)
+    {
+      memcpy(grown, arena->purged_slabs, arena->n_purged_slabs * sizeof(void *));
+      munmap(arena->purged_slabs, arena->purged_slabs_capacity * sizeof(void *));
+    }
+    arena->purged_slabs = grown;
+    arena->purged_slabs_capacity = capacity;
+  }
+  SlabPage *page = arena->free_slabs_oldest;
+  arena->free_slabs_oldest = page->prev;
+  if (page->prev != NULL)
+    page->prev->next = NULL;
+  else
+    arena->free_slabs = NULL;
+  madvise(page, kSlabPageSize, MADV_DONTNEED);
+  arena->purged_slabs[arena->n_purged_slabs++] = page;
+  return true;
+}
+
+/// Every kPurgeCheckInterval calls, update the arena clock and purge the blocks and slab pages that
+/// have been free for longer than the decay period. The arena must be locked.
+static void maybe_purge(Arena *arena)
+{
+  if (arena->clock == 0)
+    arena->clock = now_ms();
+  if (++arena->ticks < kPurgeCheckInterval)
+    return;
+  arena->ticks = 0;
+  arena->clock = now_ms();
+  if (arena->clock < arena->next_purge)
+    return;
+  uint64_t decay = __atomic_load_n(&purge_decay, __ATOMIC_RELAXED);
+  arena->next_purge = arena->clock + (decay >> 2);
+  // Purge the oldest blocks, up to the first one that is too young
+  while (arena->dirty_oldest != NULL && arena->clock - arena->dirty_oldest->free_time >= decay)
+    purge_block(arena, arena->dirty_oldest);
+  // Slab pages are smaller than huge pages, and purging them would split the huge pages
+  if (kPurgeGranularity != kSlabPageSize)
+    return;
+  while (arena->free_slabs_oldest != NULL && arena->clock - arena->free_slabs_oldest->free_time >= decay)
+  {
+    if (!purge_slab(arena))
+      break;
+  }
+}
+
+/// Ask the OS to back a mapping with transparent huge pages, when built with ENABLE_HUGEPAGES
+inline static void advise_huge_pages(void *ptr, size_t size)
+{
+#if defined(ENABLE_HUGEPAGES) && defined(MADV_HUGEPAGE)
+  madvise(ptr, size, MADV_HUGEPAGE);
+#else
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+/// Size of the next chunk of an arena that holds at least `min_size` bytes.
+/// Chunks grow geometrically with the memory the arena has mapped, up to half of it.
+static size_t next_chunk_size(Arena *arena, size_t min_size)
+{
+  size_t size = kMinChunkSize;
+  while (size < kMaxChunkSize && (size < min_size || (size << 1) <= (arena->mapped >> 1)))
+    size <<= 1;
+  assert(size >= min_size);
+  return size;
+}
+
+/// Map a chunk of `size` bytes from the OS, preferably at `hint`.
+/// Chunks are aligned to their size up to kChunkAlignment, so they can be backed by huge pages.
+static void *map_chunk(void *hint, size_t size)
+{
+  size_t alignment = size < kChunkAlignment ? size : kChunkAlignment;
+  COUNT(mmaps);
+  void *ptr = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  if ((((size_t)ptr) & (alignment - 1)) == 0)
+  {
+    advise_huge_pages(ptr, size);
+    return ptr;
+  }
+  // Over-map and trim to get an aligned chunk
+  COUNT(munmaps);
+  munmap(ptr, size);
+  COUNT(mmaps);
+  ptr = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  size_t start = size_align_up((size_t)ptr, alignment);
+  if (start != (size_t)ptr)
+  {
+    COUNT(munmaps);
+    munmap(ptr, start - (size_t)ptr);
+  }
+  size_t end = ((size_t)ptr) + size + alignment;
+  if (end != start + size)
+  {
+    COUNT(munmaps);
+    munmap((void *)(start + size), end - (start + size));
+  }
+  advise_huge_pages((void *)start, size);
+  return (void *)start;
+}
+
+/// Map the next chunk of an arena, of at least `min_size` bytes. Block chunks are asked for right
+/// below the bottom chunk first, so they can be merged. Smaller chunks are tried when the
+/// address space runs short. The size of the chunk is stored in `size`.
+static void *map_arena_chunk(Arena *arena, size_t min_size, ChunkKind kind, size_t *size)
+{
+  INSTRUMENT_PATH(kMallocChunk);
+  *size = next_chunk_size(arena, min_size);
+  if (kind == kSlabChunk && *size > kMaxSlabChunkSize)
+    *size = kMaxSlabChunkSize;
+  for (;; *size >>= 1)
+  {
+    size_t bottom = (size_t)arena->bottom;
+    void *hint = kind == kBlockChunk && bottom > *size ? (void *)(bottom - *size) : NULL;
+    void *ptr = map_chunk(hint, *size);
+    if (ptr != NULL || *size == kMinChunkSize || (*size >> 1) < min_size)
+      return ptr;
+  }
+}
+
+/// Add a chunk from the OS to an arena.
+/// Returns the allocated block covering the chunk, merged with the top or bottom block if they touch.
+/// `zeroed` is set if the data of the block past kFreeMetadataSize bytes is zero.
+static Block *add_chunk(Arena *arena, size_t *ptr, size_t size, bool *zeroed)
+{
+  register_chunk(ptr, size, arena, kBlockChunk);
+  chunk_map_slot(ptr, false)->live = size - (kFenceSize << 1);
+  arena->live += size - (kFenceSize << 1);
+  arena->mapped += size;
+  arena->chunks += 1;
+  // Mark fences
+  Block *right_fence = (Block *)(((size_t)ptr) + size - kFenceSize);
+  set_fence((Block *)ptr);
+  set_fence(right_fence);
+  right_fence->left_free = false;
+  // Initialize block metadata
+  Block *block = (Block *)(ptr + 1);
+  set_block_size(block, size - (kFenceSize << 1));
+  block->left_units = kFenceSize / kAlignment;
+  block->left_free = true;
+  block->prev = NULL;
+  block->next = NULL;
+  // Fresh pages are zero, and not resident
+  *zeroed = true;
+  ((TreeBlock *)block)->purged = true;
+  void *end = (void *)(((size_t)ptr) + size);
+  // The cursors are NULL when their chunks were unmapped. A chunk is only merged on one side,
+  // and not if that would make a block too large.
+  bool merge_bottom = arena->bottom != NULL && arena->bottom == end &&
+                      (!is_free(arena->bottom_block) || get_block_size(arena->bottom_block) + size <= kMaxBlockSize);
+  bool merge_top = !merge_bottom && arena->top != NULL && arena->top == ptr &&
+                   (!is_free(arena->top_block) || get_block_size(arena->top_block) + size <= kMaxBlockSize);
+  // Try merge bottom chunks
+  if (merge_bottom)
+  {
+    // Merge chunks
+    assert(is_fence(get_left_block(arena->bottom_block)));
+    if (is_free(arena->bottom_block))
+    {
+      *zeroed = is_zeroed(arena->bottom_block);
+      ((TreeBlock *)block)->purged = is_purged(arena->bottom_block);
+      if (is_tree_block(arena->bottom_block))
+        ((TreeBlock *)block)->free_time = ((TreeBlock *)arena->bottom_block)->free_time;
+      remove_block(arena, arena->bottom_block);
+      set_block_size(block, get_block_size(arena->bottom_block) + size);
+      if (arena->top_block == arena->bottom_block)
+        arena->top_block = block;
+      if (*zeroed)
+        memset(arena->bottom_block, 0, sizeof(TreeBlock));
+    }
+    else
+    {
+      set_block_size(block, size);
+    }
+    set_allocated(block);
+    // The fences between the chunks are now inside the block
+    account_live(arena, (void *)(((size_t)end) - kFenceSize), kFenceSize << 1, true);
+    if (*zeroed)
+      memset((void *)(((size_t)end) - kFenceSize), 0, kFenceSize << 1);
+  }
+  // Update bottom cursor
+  if (!merge_top && (arena->bottom == NULL || (size_t)ptr < (size_t)arena->bottom))
+  {
+    arena->bottom = (void *)ptr;
+    arena->bottom_block = block;
+  }
+  // Try merge top chunks
+  if (merge_top)
+  {
+    // Merge chunks
+    Block *right = get_right_block(arena->top_block);
+    assert(is_fence(right));
+    // The fences between the chunks are now inside the block
+    account_live(arena, right, kFenceSize << 1, true);
+    // Clear the fence and block metadata of the new chunk, which are now inside a block
+    memset(ptr, 0, kFenceSize + sizeof(TreeBlock));
+    if (is_free(arena->top_block))
+    {
+      *zeroed = *zeroed && is_zeroed(arena->top_block);
+      remove_block(arena, arena->top_block);
+      if (*zeroed)
+        *((size_t *)right) = 0;
+      set_block_size(arena->top_block, get_block_size(arena->top_block) + size);
+      arena->top_block->prev = NULL;
+      arena->top_block->next = NULL;
+      block = arena->top_block;
+    }
+    else
+    {
+      // The fence becomes the header of the block, and already records that the top block is allocated
+      set_block_size(right, size);
+      right->prev = NULL;
+      right->next = NULL;
+      ((TreeBlock *)right)->purged = true;
+      block = right;
+    }
+    set_allocated(block);
+  }
+  // Update top cursor
+  if (!merge_bottom && (merge_top || arena->top == NULL || (size_t)ptr >= (size_t)arena->top))
+  {
+    arena->top = end;
+    arena->top_block = block;
+  }
+  return block;
+}
+
+/// Acquire more memory from OS. Returns NULL if it is out of memory.
+static Block *acquire_more_memory(Arena *arena, size_t alloc_size, bool *zeroed)
+{
+  // Acquire one more chunk from OS
+  size_t size;
+  size_t *ptr = map_arena_chunk(arena, alloc_size + kBlockMetadataSize + (kFenceSize << 1), kBlockChunk, &size);
+  if (ptr == NULL)
+    return NULL;
+  return add_chunk(arena, ptr, size, zeroed);
+}
+
+/// Split a block into two
+static Block *split(Arena *arena, Block *block, size_t size)
+{
+
+  // Split block
+  COUNT(splits);
+  size_t total_size = get_block_size(block);
+  Block *first = block;
+  set_block_size(first, total_size - max(size + kBlockFixedMetadataSize, kBlockMetadataSize));
+  assert(get_block_size(first) >= kMinAllocationSize);
+  set_free(first);
+  Block *second = get_right_block(first);
+  set_block_size(second, total_size - get_block_size(first));
+  second->prev = NULL;
+  second->next = NULL;
+  assert(first != second);
+  set_allocated(second);
+  // Update top block
+  if (block == arena->top_block)
+    arena->top_block = second;
+  return second;
+}
+
+/// Try allocate the best fit from the general size class. Returns NULL if out of memory.
+static Block *alloc_from_general_list(Arena *arena, size_t alloc_size, bool *zeroed)
+{
+  maybe_purge(arena);
+  Block *block = (Block *)tree_best_fit(arena, max(alloc_size + kBlockFixedMetadataSize, kMinTreeBlockSize));
+  if (block != NULL)
+  {
+    *zeroed = is_zeroed(block);
+    remove_block(arena, block);
+  }
+  else
+  {
+    block = acquire_more_memory(arena, alloc_size, zeroed);
+    if (block == NULL)
+      return NULL;
+  }
+  set_allocated(block);
+  // The footer is now data, which must be zero too
+  if (*zeroed)
+    get_right_block(block)->left_units = 0;
+  block->next = NULL;
+  block->prev = NULL;
+  assert(get_block_size(block) >= alloc_size + kBlockFixedMetadataSize);
+  return block;
+}
+
+/// Allocate from one of the freelists, or NULL if out of memory.
+/// `zeroed` is set if the data of the block past kFreeMetadataSize bytes is known to be zero.
+static Block *alloc_with_size_class(Arena *arena, size_t sc, size_t alloc_size, bool *zeroed)
+{
+  if (sc < N_LISTS && arena->lists[sc] != NULL)
+  {
+    // Current list is not empty
+    INSTRUMENT_LOOKUP(kMallocList);
+    Block *block = arena->lists[sc];
+    remove_block(arena, block);
+    set_allocated(block);
+    assert(get_block_size(block) >= alloc_size + kBlockFixedMetadataSize);
+    *zeroed = false;
+    return block;
+  }
+  else
+  {
+    if (sc < N_LISTS)
+      INSTRUMENT_SKIP();
+    else
+      INSTRUMENT_LOOKUP(kMallocTree);
+    Block *block = sc < N_LISTS ? alloc_with_size_class(arena, sc + 1, alloc_size, zeroed) : alloc_from_general_list(arena, alloc_size, zeroed);
+    if (block == NULL)
+      return NULL;
+    if (get_block_size(block) >= alloc_size + (kBlockMetadataSize << 1) + kMinAllocationSize)
+    {
+      Block *second = split(arena, block, alloc_size);
+      Block *first = block;
+      // The remainder keeps the purge state of the block
+      set_zeroed(first, *zeroed);
+      add_block(arena, first);
+      block = second;
+      assert(get_block_size(block) >= alloc_size + kBlockFixedMetadataSize);
+    }
+    assert(get_block_size(block) >= alloc_size + kBlockFixedMetadataSize);
+    assert(!is_free(block));
+    return block;
+  }
+}
+
+/// Allocate `n` blocks of a rounded up size. Blocks of the size class are taken first, then the rest is carved
+/// out of one free block in a single pass, leaving one remainder. Returns the number of blocks allocated,
+/// fewer than `n` only if out of memory.
+static size_t alloc_block_batch(Arena *arena, size_t alloc_size, size_t n, void **out)
+{
+  size_t sc = size_class(alloc_size);
+  size_t done = 0;
+  for (; done < n && sc < N_LISTS && arena->lists[sc] != NULL; done++)
+  {
+    Block *block = arena->lists[sc];
+    remove_block(arena, block);
+    set_allocated(block);
+    *out++ = block_to_data(block);
+  }
+  size_t block_size = max(alloc_size + kBlockFixedMetadataSize, kBlockMetadataSize);
+  while (done < n)
+  {
+    // A free block for the rest of the batch, unless it would be too large for one chunk
+    size_t count = n - done < kMaxBlockAllocationSize / block_size ? n - done : kMaxBlockAllocationSize / block_size;
+    bool zeroed;
+    Block *block = alloc_from_general_list(arena, count * block_size - kBlockFixedMetadataSize, &zeroed);
+    if (block == NULL)
+      break;
+    size_t rest = get_block_size(block) - count * block_size;
+    if (rest < kBlockMetadataSize + kMinAllocationSize)
+      rest = 0;
+    Block *right = get_right_block(block);
+    bool top = block == arena->top_block;
+    // The remainder stays at the bottom, like the first half of a split
+    Block *carved = block;
+    if (rest != 0)
+    {
+      COUNT(splits);
+      set_block_size(block, rest);
+      set_free(block);
+      set_zeroed(block, zeroed);
+      add_block(arena, block);
+      carved = get_right_block(block);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+      set_block_size(carved, i + 1 < count ? block_size : ((size_t)right) - ((size_t)carved));
+      carved->prev = NULL;
+      carved->next = NULL;
+      *out++ = block_to_data(carved);
+      Block *next = get_right_block(carved);
+      set_allocated(carved);
+      if (i + 1 == count && top)
+        arena->top_block = carved;
+      carved = next;
+    }
+    COUNT_N(splits, count - 1);
+    done += count;
+  }
+  return done;
+}
+
+/// Coalesce two neighbour blocks
+static void coalesce_blocks(Arena *arena, Block *left, Block *right)
+{
+  assert(right == get_right_block(left));
+  COUNT(coalesces);
+  bool zeroed = is_zeroed(left) && is_zeroed(right);
+  bool purged = is_purged(left) && is_purged(right);
+  uint64_t free_time = max(is_tree_block(left) ? ((TreeBlock *)left)->free_time : 0, is_tree_block(right) ? ((TreeBlock *)right)->free_time : 0);
+  // Remove left from the list. Both stay free, so the chunks do not need accounting.
+  unlink_block(arena, left);
+  // Remove right from the list
+  unlink_block(arena, right);
+  // Merge left and right, and update the footer
+  set_block_size(left, get_block_size(left) + get_block_size(right));
+  set_free(left);
+  // The metadata of right is now inside a block
+  if (zeroed)
+    memset(right, 0, sizeof(TreeBlock));
+  // Add left back to list
+  set_free_state(left, zeroed, purged, free_time);
+  link_block(arena, left);
+  // Update top block
+  if (right == arena->top_block)
+    arena->top_block = left;
+}
+
+/// Return an allocated block to the freelists of its arena, keeping its chunks mapped.
+/// Returns the free block it was coalesced into.
+static Block *add_free_block(Arena *arena, Block *block)
+{
+  assert(!is_free(block));
+  maybe_purge(arena);
+  set_free(block);
+  // Add block to freelist
+  set_free_state(block, false, false, arena->clock);
+  add_block(arena, block);
+  // Try coalescing, unless the block would get too large
   // 1. Merge with right neighbour
   Block *right = get_right_block(block);
-  if (!is_fence(right) && right->free)
-    coalesce_blocks(block, right);
-  // 2. Merge with left neighbour
-  Block *left = get_left_block(block);
-  if (!is_fence(left) && left->free)
-    coalesce_blocks(left, block);
+  if (!is_fence(right) && is_free(right) && get_block_size(block) + get_block_size(right) <= kMaxBlockSize)
+    coalesce_blocks(arena, block, right);
+  // 2. Merge with left neighbour, which is known if it is free
+  if (block->left_free)
+  {
+    Block *left = get_left_block(block);
+    if (!is_fence(left) && get_block_size(left) + get_block_size(block) <= kMaxBlockSize)
+    {
+      coalesce_blocks(arena, left, block);
+      block = left;
+    }
+  }
+  return block;
+}
+
+/// Unmap a chunk without allocated blocks, which lies inside the free block `block`.
+/// The parts of the block below and above the chunk stay free, and get fences where the chunk was.
+/// Returns the part above the chunk (NULL if there is none), or `block` if the chunk cannot be removed.
+static Block *release_chunk(Arena *arena, Block *block, size_t chunk)
+{
+  INSTRUMENT_PATH(kFreeRelease);
+  size_t start = (size_t)block;
+  size_t end = start + get_block_size(block);
+  size_t chunk_size = chunk_map_slot((void *)chunk, false)->size;
+  size_t chunk_end = chunk + chunk_size;
+  // Blocks are not coalesced beyond kMaxBlockSize, so the chunk may span several free blocks
+  if (start > chunk + kFenceSize || end < chunk_end - kFenceSize)
+    return block;
+  // The chunk is the first or last of its mapping if it holds the fence there
+  bool first = start == chunk + kFenceSize && block->left_free && is_fence(get_left_block(block));
+  bool last = end == chunk_end - kFenceSize && is_fence(get_right_block(block));
+  // New fences go in the last word before the chunk and the first word after it,
+  // which must not hold the neighbours of the block
+  if ((!first && start + kFenceSize > chunk) || (!last && end < chunk_end + kFenceSize))
+    return block;
+  // The parts of the block around the chunk must be empty or large enough for a block
+  size_t below_size = first ? 0 : chunk - kFenceSize - start;
+  size_t above_size = last ? 0 : end - chunk_end - kFenceSize;
+  if ((below_size != 0 && below_size < kBlockMetadataSize) || (above_size != 0 && above_size < kBlockMetadataSize))
+    return block;
+  LOG("unmap chunk %p\n", (void *)chunk);
+  bool zeroed = is_zeroed(block);
+  bool purged = is_purged(block);
+  uint64_t free_time = is_tree_block(block) ? ((TreeBlock *)block)->free_time : 0;
+  // An allocated left neighbour is not known, and is left out of the top cursor
+  Block *left = first || !block->left_free ? NULL : get_left_block(block);
+  Block *right = last ? NULL : get_right_block(block);
+  remove_block(arena, block);
+  // Part below the chunk
+  Block *below = left;
+  if (!first)
+  {
+    if (below_size != 0)
+    {
+      below = block;
+      set_block_size(below, below_size);
+      set_free(below);
+      set_free_state(below, zeroed, purged, free_time);
+      add_block(arena, below);
+    }
+    set_fence((Block *)(chunk - kFenceSize));
+    account_live(arena, (void *)(chunk - kFenceSize), kFenceSize, false);
+  }
+  // Part above the chunk
+  Block *above = right;
+  if (!last)
+  {
+    set_fence((Block *)chunk_end);
+    account_live(arena, (void *)chunk_end, kFenceSize, false);
+    if (above_size != 0)
+    {
+      above = (Block *)(chunk_end + kFenceSize);
+      set_block_size(above, above_size);
+      set_free(above);
+      set_free_state(above, zeroed, purged, free_time);
+      add_block(arena, above);
+    }
+    above->left_units = kFenceSize / kAlignment;
+    above->left_free = true;
+  }
+  // Fix up the cursors
+  if (arena->bottom == (void *)chunk)
+  {
+    arena->bottom = last ? NULL : (void *)chunk_end;
+    arena->bottom_block = above;
+  }
+  if (arena->top == (void *)chunk_end)
+  {
+    arena->top = below == NULL ? NULL : (void *)chunk;
+    arena->top_block = below;
+  }
+  else if (arena->top_block == block && !last)
+  {
+    arena->top_block = above;
+  }
+  // The chunk was counted as free before its block was removed
+  // Clear the entries of the chunk
+  arena->live -= chunk_map_slot((void *)chunk, false)->live;
+  chunk_map_slot((void *)chunk, false)->live = 0;
+  register_chunk((void *)chunk, chunk_size, NULL, kBlockChunk);
+  arena->mapped -= chunk_size;
+  arena->chunks -= 1;
+  COUNT(munmaps);
+  munmap((void *)chunk, chunk_size);
+  return above_size != 0 ? above : NULL;
+}
+
+/// Unmap the chunks inside a free block that have no allocated blocks, while the arena has more than
+/// SPARE_CHUNKS of them or more than SPARE_BYTES in them
+static void release_free_chunks(Arena *arena, Block *block)
+{
+  size_t chunk = chunk_map_slot(block, false)->start;
+  while (block != NULL && (arena->free_chunks > SPARE_CHUNKS || arena->free_chunk_bytes > SPARE_BYTES) &&
+         chunk < ((size_t)block) + get_block_size(block))
+  {
+    ChunkInfo *info = chunk_map_slot((void *)chunk, false);
+    size_t chunk_size = info->size;
+    if (info->live == 0)
+      block = release_chunk(arena, block, chunk);
+    chunk += chunk_size;
+  }
+}
+
+/// Return an allocated block to the freelists of its arena
+static void free_block(Arena *arena, Block *block)
+{
+  INSTRUMENT_PATH(kFreeBlock);
+  release_free_chunks(arena, add_free_block(arena, block));
+}
+
+/// Shrink an allocated block to hold `size` bytes, and free the tail if it is large enough for a block
+static void trim_block(Arena *arena, Block *block, size_t size)
+{
+  size_t block_size = max(size + kBlockFixedMetadataSize, kBlockMetadataSize);
+  if (get_block_size(block) < block_size + kBlockMetadataSize + kMinAllocationSize)
+    return;
+  // The left_units of the tail is the end of the data of the block
+  Block *tail = (Block *)(((size_t)block) + block_size);
+  set_block_size(tail, get_block_size(block) - block_size);
+  tail->left_free = false;
+  set_block_size(block, block_size);
+  if (block == arena->top_block)
+    arena->top_block = tail;
+  free_block(arena, tail);
+}
+
+/// Resize an allocated block in place to hold between `min_size` and `max_size` bytes, by absorbing
+/// its free right neighbour or splitting off its tail. The top block can grow into a chunk
+/// mapped right above it. Returns false if the block cannot hold `min_size` bytes without moving.
+static bool resize_block(Arena *arena, Block *block, size_t min_size, size_t max_size)
+{
+  assert(!is_free(block) && min_size <= max_size);
+  size_t min_block_size = min_size + kBlockFixedMetadataSize;
+  Block *right = get_right_block(block);
+  if (get_block_size(block) < min_block_size)
+  {
+    bool at_top = block == arena->top_block || (!is_fence(right) && is_free(right) && right == arena->top_block);
+    if (at_top)
+    {
+      // Map a chunk right above the top chunk, if that space is available
+      size_t size = next_chunk_size(arena, min_block_size - get_block_size(block));
+      COUNT(mmaps);
+      void *ptr = mmap(arena->top, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      bool zeroed;
+      if (ptr == arena->top)
+      {
+        advise_huge_pages(ptr, size);
+        add_free_block(arena, add_chunk(arena, ptr, size, &zeroed));
+      }
+      else if (ptr != MAP_FAILED)
+      {
+        COUNT(munmaps);
+        munmap(ptr, size);
+      }
+      right = get_right_block(block);
+    }
+    if (is_fence(right) || !is_free(right) || get_block_size(block) + get_block_size(right) < min_block_size || get_block_size(block) + get_block_size(right) > kMaxBlockSize)
+      return false;
+    // Absorb the right neighbour
+    remove_block(arena, right);
+    set_block_size(block, get_block_size(block) + get_block_size(right));
+    set_allocated(block);
+    if (right == arena->top_block)
+      arena->top_block = block;
+  }
+  trim_block(arena, block, max_size);
+  return true;
+}
+
+/// Allocate a block whose data is aligned to `alignment`, or NULL if out of memory.
+/// The leading and trailing slack is returned to the freelists.
+static Block *alloc_aligned_block(Arena *arena, size_t size, size_t alignment)
+{
+  // Leave room for a free block before the aligned data
+  size_t alloc_size = size + size_align_up(alignment + kBlockMetadataSize, kMallocAlignment);
+  bool zeroed;
+  Block *block = alloc_with_size_class(arena, size_class(alloc_size), alloc_size, &zeroed);
+  if (block == NULL)
+    return NULL;
+  size_t data = (size_t)block_to_data(block);
+  if ((data & (alignment - 1)) != 0)
+  {
+    // Split off the leading slack
+    size_t aligned = size_align_up(data + kBlockMetadataSize, alignment);
+    Block *lead = block;
+    block = data_to_block((void *)aligned);
+    set_block_size(block, get_block_size(lead) - (aligned - data));
+    block->left_free = false;
+    set_block_size(lead, aligned - data);
+    if (lead == arena->top_block)
+      arena->top_block = block;
+    free_block(arena, lead);
+  }
+  trim_block(arena, block, size);
+  return block;
+}
+
+/// Unlink a slab page from the list of its size class
+static void unlink_slab(Arena *arena, SlabPage *page)
+{
+  if (page->prev != NULL)
+    page->prev->next = page->next;
+  else
+    arena->slabs[page->size_class] = page->next;
+  if (page->next != NULL)
+    page->next->prev = page->prev;
+  page->prev = NULL;
+  page->next = NULL;
+}
+
+/// Push a slab page to the list of its size class
+static void push_slab(Arena *arena, SlabPage *page)
+{
+  page->prev = NULL;
+  page->next = arena->slabs[page->size_class];
+  if (page->next != NULL)
+    page->next->prev = page;
+  arena->slabs[page->size_class] = page;
+}
+
+/// Get an empty slab page for a size class, or NULL if out of memory
+static SlabPage *alloc_slab(Arena *arena, size_t sc)
+{
+  SlabPage *page = arena->free_slabs;
+  if (page != NULL)
+  {
+    // Take the most recently emptied page, whose memory is the most likely to be resident
+    arena->free_slabs = page->next;
+    if (page->next != NULL)
+      page->next->prev = NULL;
+    else
+      arena->free_slabs_oldest = NULL;
+  }
+  else if (arena->n_purged_slabs != 0)
+  {
+    page = arena->purged_slabs[--arena->n_purged_slabs];
+  }
+  else
+  {
+    // Carve a page from the current slab chunk
+    if (arena->slab_cursor == arena->slab_end)
+    {
+      size_t size;
+      void *chunk = map_arena_chunk(arena, kSlabPageSize, kSlabChunk, &size);
+      if (chunk == NULL)
+        return NULL;
+      register_chunk(chunk, size, arena, kSlabChunk);
+      arena->mapped += size;
+      arena->chunks += 1;
+      arena->slab_cursor = (size_t)chunk;
+      arena->slab_end = arena->slab_cursor + size;
+    }
+    page = (SlabPage *)arena->slab_cursor;
+    arena->slab_cursor += kSlabPageSize;
+  }
+  page->object_size = kSlabClassSizes[sc];
+  page->n_objects = (kSlabPageSize - kSlabHeaderSize) / page->object_size;
+  page->n_free = page->n_objects;
+  page->size_class = sc;
+  memset(page->bitmap, 0, sizeof(page->bitmap));
+  for (size_t i = 0; i < page->n_objects; i += 64)
+    page->bitmap[i >> 6] = page->n_objects - i >= 64 ? ~0ull : (1ull << (page->n_objects - i)) - 1;
+  push_slab(arena, page);
+  return page;
+}
+
+/// Allocate an object of a slab size class, or NULL if out of memory
+static void *slab_alloc(Arena *arena, size_t sc)
+{
+  INSTRUMENT_PATH(kMallocSlab);
+  SlabPage *page = arena->slabs[sc];
+  if (page == NULL && (page = alloc_slab(arena, sc)) == NULL)
+    return NULL;
+  // Take the first free slot
+  size_t i = 0;
+  while (page->bitmap[i] == 0)
+    i++;
+  size_t bit = __builtin_ctzll(page->bitmap[i]);
+  page->bitmap[i] &= ~(1ull << bit);
+  page->n_free -= 1;
+  arena->live += page->object_size;
+  // Full pages leave the list
+  if (page->n_free == 0)
+    unlink_slab(arena, page);
+  return (void *)(((size_t)page) + kSlabHeaderSize + ((i << 6) + bit) * page->object_size);
+}
+
+/// Allocate `n` objects of a slab size class, taking all the free slots of a page before the next.
+/// Returns the number of objects allocated, fewer than `n` only if out of memory.
+static size_t slab_alloc_batch(Arena *arena, size_t sc, size_t n, void **out)
+{
+  INSTRUMENT_PATH(kMallocSlab);
+  size_t done = 0;
+  while (done < n)
+  {
+    SlabPage *page = arena->slabs[sc];
+    if (page == NULL && (page = alloc_slab(arena, sc)) == NULL)
+      break;
+    size_t taken = 0;
+    for (size_t i = 0; done < n && taken < page->n_free; i++)
+    {
+      for (; page->bitmap[i] != 0 && done < n; done++, taken++)
+      {
+        size_t bit = __builtin_ctzll(page->bitmap[i]);
+        page->bitmap[i] &= page->bitmap[i] - 1;
+        *out++ = (void *)(((size_t)page) + kSlabHeaderSize + ((i << 6) + bit) * page->object_size);
+      }
+    }
+    page->n_free -= taken;
+    arena->live += taken * page->object_size;
+    if (page->n_free == 0)
+      unlink_slab(arena, page);
+  }
+  return done;
+}
+
+/// Get the slab page of an object
+inline static SlabPage *object_to_slab(void *ptr)
+{
+  return (SlabPage *)(((size_t)ptr) & ~(kSlabPageSize - 1));
+}
+
+/// Free an object of a slab page
+static void slab_free(Arena *arena, void *ptr)
+{
+  INSTRUMENT_PATH(kFreeSlab);
+  SlabPage *page = object_to_slab(ptr);
+  size_t index = (((size_t)ptr) - ((size_t)page) - kSlabHeaderSize) / page->object_size;
+  assert(index < page->n_objects);
+  assert((page->bitmap[index >> 6] & (1ull << (index & 63))) == 0);
+  page->bitmap[index >> 6] |= 1ull << (index & 63);
+  page->n_free += 1;
+  arena->live -= page->object_size;
+  if (page->n_free == 1)
+  {
+    // Page was full
+    push_slab(arena, page);
+  }
+  else if (page->n_free == page->n_objects && (arena->slabs[page->size_class] != page || page->next != NULL))
+  {
+    // Release empty pages, but keep the last one of the size class
+    unlink_slab(arena, page);
+    maybe_purge(arena);
+    page->free_time = arena->clock;
+    page->prev = NULL;
+    page->next = arena->free_slabs;
+    if (page->next != NULL)
+      page->next->prev = page;
+    else
+      arena->free_slabs_oldest = page;
+    arena->free_slabs = page;
+  }
+}
+
+/// Free an object into its arena
+static void arena_free(Arena *arena, ChunkKind kind, void *ptr)
+{
+  if (kind == kSlabChunk)
+    slab_free(arena, ptr);
+  else
+    free_block(arena, data_to_block(ptr));
+}
+
+#ifdef ENABLE_PROFILE
+// Allocations are sampled once every PROFILE_RATE bytes on average. Each thread counts down the
+// bytes until its next sample, drawn from an exponential distribution, so the samples of a call
+// stack are a Poisson process over its allocated bytes and can be scaled back to its total.
+#ifndef PROFILE_RATE
+#define PROFILE_RATE (512 << 10)
+#endif
+
+#define SAMPLE_BUCKET_BITS 14
+
+static const size_t kProfileSkipFrames = 2;             // profile_sample and the entry point
+static const int64_t kProfileRecheckBytes = 1ll << 20; // Countdown while sampling is off, to notice it being turned on
+
+static size_t sample_rate = PROFILE_RATE;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+// Live samples are kept aside in a hash table keyed by their object, so sampled objects keep
+// their usual layout. Frees only look up objects whose bucket is not empty.
+static Sample *sample_buckets[1 << SAMPLE_BUCKET_BITS];
+static Sample *free_samples = NULL; // Records of freed samples
+static __thread int64_t bytes_until_sample = 0;
+static __thread uint64_t sample_seed = 0;
+static __thread bool sampling = false; // Allocations made while taking a sample are not sampled
+
+/// Get the bucket of the sample of an object
+inline static Sample **sample_bucket(void *ptr)
+{
+  return &sample_buckets[(((size_t)ptr >> 3) * 0x9e3779b97f4a7c15ull) >> (64 - SAMPLE_BUCKET_BITS)];
+}
+
+/// Take the sample of an object out of its bucket, if it has one. Called with the profile lock held.
+static Sample *take_sample(void *ptr)
+{
+  Sample **bucket = sample_bucket(ptr);
+  for (Sample **link = bucket; *link != NULL; link = &(*link)->next)
+  {
+    Sample *sample = *link;
+    if (sample->ptr == ptr)
+    {
+      __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+      return sample;
+    }
+  }
+  return NULL;
+}
+
+/// Add a sample to the bucket of its object. Called with the profile lock held.
+static void put_sample(Sample *sample)
+{
+  Sample **bucket = sample_bucket(sample->ptr);
+  sample->next = *bucket;
+  __atomic_store_n(bucket, sample, __ATOMIC_RELAXED);
+}
+
+/// Drop the sample of an object that is freed
+inline static void unsample(void *ptr)
+{
+  if (__atomic_load_n(sample_bucket(ptr), __ATOMIC_RELAXED) == NULL)
+    return;
+  pthread_mutex_lock(&profile_lock);
+  Sample *sample = take_sample(ptr);
+  if (sample != NULL)
+  {
+    sample->next = free_samples;
+    free_samples = sample;
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/// Make the sample of a resized object follow it
+inline static void resample(void *ptr, void *data, size_t size)
+{
+  if (__atomic_load_n(sample_bucket(ptr), __ATOMIC_RELAXED) == NULL)
+    return;
+  pthread_mutex_lock(&profile_lock);
+  Sample *sample = take_sample(ptr);
+  if (sample != NULL)
+  {
+    sample->ptr = data;
+    sample->size = size;
+    put_sample(sample);
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+#else
+#define unsample(ptr) ((void)0)
+#define resample(ptr, data, size) ((void)0)
+#endif
+
+/// Allocate a huge object in a dedicated mapping
+static void *huge_alloc(size_t size, size_t alignment)
+{
+  INSTRUMENT_PATH(kMallocHuge);
+#ifdef ENABLE_HUGEPAGES
+  // Start the data at a huge page, so all but its last partial huge page can be backed by huge pages
+  if (size >= kHugePageSize)
+    alignment = max(alignment, kHugePageSize);
+#endif
+  // Over-map for alignment, then return whole pages before the header and after the data
+  size_t map_size = size_align_up(size + (alignment > kPageSize ? kHugeHeaderSize + alignment : size_align_up(kHugeHeaderSize, alignment)), kPageSize);
+  COUNT(mmaps);
+  void *ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  size_t data = size_align_up(((size_t)ptr) + kHugeHeaderSize, alignment);
+  size_t start = (data - kHugeHeaderSize) & ~(kPageSize - 1);
+  size_t end = size_align_up(data + size, kPageSize);
+  if (start != (size_t)ptr)
+  {
+    COUNT(munmaps);
+    munmap(ptr, start - (size_t)ptr);
+  }
+  if (end != ((size_t)ptr) + map_size)
+  {
+    COUNT(munmaps);
+    munmap((void *)end, ((size_t)ptr) + map_size - end);
+  }
+  advise_huge_pages((void *)start, end - start);
+  __atomic_fetch_add(&huge_mapped, end - start, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&huge_count, 1, __ATOMIC_RELAXED);
+  // Only the granule of the data pointer needs an entry
+  register_chunk((void *)data, 1, NULL, kHugeChunk);
+  HugeHeader *header = ((HugeHeader *)data) - 1;
+  header->size = end - start;
+  header->offset = data - start;
+  return (void *)data;
+}
+
+/// Get the header of a huge object
+inline static HugeHeader *huge_header(void *ptr)
+{
+  return ((HugeHeader *)ptr) - 1;
+}
+
+/// Get the start of the mapping of a huge object
+inline static void *huge_mapping(void *ptr)
+{
+  return (void *)(((size_t)ptr) - huge_header(ptr)->offset);
+}
+
+/// Get the usable size of a huge object
+inline static size_t huge_size(void *ptr)
+{
+  return huge_header(ptr)->size - huge_header(ptr)->offset;
+}
+
+/// Release the mapping of a huge object
+static void huge_free(void *ptr)
+{
+  INSTRUMENT_PATH(kFreeHuge);
+  size_t size = huge_size(ptr);
+  // Buffers of this size are not long-lived enough to deserve a mapping
+  size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+  if (size > threshold && size <= kMaxMmapThreshold)
+    __atomic_store_n(&mmap_threshold, size, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&huge_mapped, huge_header(ptr)->size, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&huge_count, 1, __ATOMIC_RELAXED);
+  COUNT(munmaps);
+  munmap(huge_mapping(ptr), huge_header(ptr)->size);
+}
+
+/// Resize a huge object. Its pages are remapped rather than copied when it moves.
+static void *huge_realloc(void *ptr, size_t size)
+{
+  HugeHeader *header = huge_header(ptr);
+  size_t offset = header->offset;
+  size_t map_size = size_align_up(size + offset, kPageSize);
+  if (map_size == header->size)
+    return ptr;
+  COUNT(mmaps);
+#ifdef MREMAP_MAYMOVE
+  void *moved = mremap(huge_mapping(ptr), header->size, map_size, MREMAP_MAYMOVE);
+  if (moved == MAP_FAILED)
+    return NULL;
+#else
+  void *moved = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (moved == MAP_FAILED)
+    return NULL;
+  advise_huge_pages(moved, map_size);
+  memcpy(moved, huge_mapping(ptr), header->size < map_size ? header->size : map_size);
+  COUNT(munmaps);
+  munmap(huge_mapping(ptr), header->size);
+#endif
+  void *data = (void *)(((size_t)moved) + offset);
+  register_chunk(data, 1, NULL, kHugeChunk);
+  __atomic_fetch_add(&huge_mapped, map_size - huge_header(data)->size, __ATOMIC_RELAXED);
+  huge_header(data)->size = map_size;
+  return data;
+}
+
+/// Resize a huge object in place. Returns its new size, or 0 if it cannot hold `min_size` bytes without moving.
+static size_t huge_resize(void *ptr, size_t min_size, size_t max_size)
+{
+  HugeHeader *header = huge_header(ptr);
+#ifdef MREMAP_MAYMOVE
+  size_t sizes[2] = {max_size, min_size};
+  for (size_t i = 0; i < 2; i++)
+  {
+    size_t map_size = size_align_up(sizes[i] + header->offset, kPageSize);
+    if (map_size != header->size)
+      COUNT(mmaps);
+    if (map_size == header->size || mremap(huge_mapping(ptr), header->size, map_size, 0) != MAP_FAILED)
+    {
+      __atomic_fetch_add(&huge_mapped, map_size - header->size, __ATOMIC_RELAXED);
+      header->size = map_size;
+      return huge_size(ptr);
+    }
+  }
+  return 0;
+#else
+  return huge_size(ptr) >= min_size ? huge_size(ptr) : 0;
+#endif
+}
+
+/// Resize an object in place to hold between `min_size` and `max_size` bytes.
+/// Returns its new size, or 0 if it cannot hold `min_size` bytes without moving.
+static size_t resize_in_place(size_t entry, void *ptr, size_t min_size, size_t max_size)
+{
+  if (entry_kind(entry) == kHugeChunk)
+    return huge_resize(ptr, min_size, max_size);
+  if (entry_kind(entry) == kSlabChunk)
+  {
+    size_t size = object_to_slab(ptr)->object_size;
+    return size >= min_size ? size : 0;
+  }
+  min_size = block_alloc_size(min_size);
+  max_size = max(block_alloc_size(max_size), min_size);
+  if (min_size > kMaxBlockAllocationSize)
+    return 0;
+  Block *block = data_to_block(ptr);
+  Arena *arena = entry_arena(entry);
+#ifdef ENABLE_THREADS
+  pthread_mutex_lock(&arena->lock);
+#endif
+  size_t size = resize_block(arena, block, min_size, max_size) ? block_usable_size(block) : 0;
+#ifdef ENABLE_THREADS
+  pthread_mutex_unlock(&arena->lock);
+#endif
+  return size;
+}
+
+/// Get the usable size of an object
+static size_t object_size(size_t entry, void *ptr)
+{
+  if (entry_kind(entry) == kHugeChunk)
+    return huge_size(ptr);
+  if (entry_kind(entry) == kSlabChunk)
+    return object_to_slab(ptr)->object_size;
+  return block_usable_size(data_to_block(ptr));
+}
+
+#ifdef ENABLE_THREADS
+/// Get the next object in a thread cache bin or a remote free list
+inline static void **object_next(void *ptr)
+{
+  return (void **)ptr;
+}
+
+/// Free the objects pushed to the arena by other threads. The arena must be locked.
+static void drain_remote_frees(Arena *arena)
+{
+  if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+    return;
+  void *ptr = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  while (ptr != NULL)
+  {
+    void *next = *object_next(ptr);
+    arena_free(arena, entry_kind(chunk_entry(ptr)), ptr);
+    ptr = next;
+  }
+}
+
+/// Free the remote frees of an arena whose last thread left it, as nobody else will.
+/// The caller must not hold any arena lock.
+static void drain_orphaned_arena(Arena *arena)
+{
+  // Pairs with the fence of remote_free: either the pusher sees no threads, or its objects are drained here
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&arena->lock);
+  drain_remote_frees(arena);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/// Lock the arena of the current thread, and free the objects other threads left for it.
+/// If it is contended, switch the thread to the first idle arena instead of waiting.
+static Arena *arena_lock(TCache *cache)
+{
+  Arena *arena = cache->arena;
+  if (pthread_mutex_trylock(&arena->lock) != 0)
+  {
+    size_t index = (size_t)(arena - arenas);
+    Arena *locked = NULL;
+    for (size_t i = 1; i < n_arenas && locked == NULL; i++)
+    {
+      Arena *other = &arenas[(index + i) % n_arenas];
+      if (pthread_mutex_trylock(&other->lock) == 0)
+        locked = other;
+    }
+    if (locked != NULL)
+    {
+      __atomic_fetch_add(&locked->nthreads, 1, __ATOMIC_RELAXED);
+      cache->arena = locked;
+      if (__atomic_sub_fetch(&arena->nthreads, 1, __ATOMIC_SEQ_CST) == 0)
+      {
+        // The old arena is left without threads. Drain it without holding the new one, so two
+        // arena locks are never held at once.
+        pthread_mutex_unlock(&locked->lock);
+        drain_orphaned_arena(arena);
+        pthread_mutex_lock(&locked->lock);
+      }
+      arena = locked;
+    }
+    else
+    {
+      pthread_mutex_lock(&arena->lock);
+    }
+  }
+  drain_remote_frees(arena);
+  return arena;
+}
+
+/// Check if an object of `arena` freed by this thread should go to the arena's remote free list.
+/// Arenas without threads never drain the list, so those take the lock instead.
+inline static bool is_remote_free(TCache *cache, Arena *arena)
+{
+#ifdef DISABLE_REMOTE_FREE
+  USE(cache);
+  USE(arena);
+  return false;
+#else
+  return arena != cache->arena && __atomic_load_n(&arena->nthreads, __ATOMIC_RELAXED) != 0;
+#endif
+}
+
+/// Push a chain of objects to the remote free list of an arena. Returns true if the last thread of the
+/// arena left it meanwhile, and may have drained it before the push: the caller must then call
+/// drain_orphaned_arena once it holds no arena lock.
+static bool remote_free(Arena *arena, void *first, void *last)
+{
+  INSTRUMENT_PATH(kFreeRemote);
+  void *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+  do
+  {
+    *object_next(last) = head;
+  } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&arena->nthreads, __ATOMIC_RELAXED) == 0;
+}
+
+/// Push a chain of objects to the remote free list of an arena from tcache_flush, releasing
+/// the lock the flush holds if the arena needs a drain
+static void flush_remote(Arena **locked, Arena *arena, void *first, void *last)
+{
+  if (!remote_free(arena, first, last))
+    return;
+  if (*locked != NULL)
+    pthread_mutex_unlock(&(*locked)->lock);
+  *locked = NULL;
+  drain_orphaned_arena(arena);
+}
+
+/// Flush `count` objects of a cache bin back to their arenas
+static void tcache_flush(TCache *cache, size_t bin, size_t count)
+{
+  INSTRUMENT_PATH(kFreeFlush);
+  Arena *locked = NULL;
+  // Chain of objects for the remote free list of another arena
+  Arena *remote = NULL;
+  void *first = NULL;
+  void *last = NULL;
+  while (count-- > 0 && cache->bins[bin] != NULL)
+  {
+    void *ptr = cache->bins[bin];
+    cache->bins[bin] = *object_next(ptr);
+    cache->counts[bin] -= 1;
+    size_t entry = chunk_entry(ptr);
+    Arena *arena = entry_arena(entry);
+    if (is_remote_free(cache, arena))
+    {
+      if (arena != remote && first != NULL)
+      {
+        flush_remote(&locked, remote, first, last);
+        first = NULL;
+      }
+      remote = arena;
+      if (first == NULL)
+        last = ptr;
+      *object_next(ptr) = first;
+      first = ptr;
+      continue;
+    }
+    // Objects from the same arena are usually adjacent in the bin, so keep the lock across them
+    if (arena != locked)
+    {
+      if (locked != NULL)
+        pthread_mutex_unlock(&locked->lock);
+      pthread_mutex_lock(&arena->lock);
+      locked = arena;
+    }
+    arena_free(arena, entry_kind(entry), ptr);
+  }
+  if (first != NULL)
+    flush_remote(&locked, remote, first, last);
+  if (locked != NULL)
+    pthread_mutex_unlock(&locked->lock);
+}
+
+/// Add a set of counters to another, while their thread may still bump them
+static void add_counters(Counters *total, Counters *counters)
+{
+  for (size_t i = 0; i < sizeof(Counters) / sizeof(size_t); i++)
+    ((size_t *)total)[i] += __atomic_load_n(&((size_t *)counters)[i], __ATOMIC_RELAXED);
+}
+
+/// Move the counters of a cache to the retired counters, and unregister it. stats_lock must be held.
+static void retire_counters(TCache *cache)
+{
+  for (size_t i = 0; i < sizeof(Counters) / sizeof(size_t); i++)
+    __atomic_fetch_add(&((size_t *)&retired_counters)[i], ((size_t *)&cache->counters)[i], __ATOMIC_RELAXED);
+  memset(&cache->counters, 0, sizeof(Counters));
+  if (cache->prev != NULL)
+    cache->prev->next = cache->next;
+  else
+    registered_caches = cache->next;
+  if (cache->next != NULL)
+    cache->next->prev = cache->prev;
+  cache->prev = NULL;
+  cache->next = NULL;
+}
+
+/// Drain a thread's cache and release its arena when the thread exits
+static void tcache_destroy(void *arg)
+{
+  TCache *cache = arg;
+  for (size_t bin = 0; bin < N_TCACHE_BINS; bin++)
+    tcache_flush(cache, bin, cache->counts[bin]);
+  if (__atomic_sub_fetch(&cache->arena->nthreads, 1, __ATOMIC_SEQ_CST) == 0)
+    drain_orphaned_arena(cache->arena);
+  cache->arena = NULL;
+  pthread_mutex_lock(&stats_lock);
+  retire_counters(cache);
+  cache->registered = false;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/// Hold all arena locks across fork, so the child does not inherit a heap in the middle of an update
+static void fork_prepare(void)
+{
+  for (size_t i = 0; i < MAX_ARENAS; i++)
+    pthread_mutex_lock(&arenas[i].lock);
+  pthread_mutex_lock(&stats_lock);
+}
+
+static void fork_parent(void)
+{
+  pthread_mutex_unlock(&stats_lock);
+  for (size_t i = 0; i < MAX_ARENAS; i++)
+    pthread_mutex_unlock(&arenas[i].lock);
+}
+
+/// Only the forking thread survives in the child
+static void fork_child(void)
+{
+  for (size_t i = 0; i < MAX_ARENAS; i++)
+  {
+    arenas[i].nthreads = 0;
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  if (tcache.registered)
+    tcache.arena->nthreads = 1;
+  // The caches of the other threads are gone
+  for (TCache *cache = registered_caches, *next; cache != NULL; cache = next)
+  {
+    next = cache->next;
+    if (cache != &tcache)
+      retire_counters(cache);
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static void init(void)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  n_arenas = ncpus > 0 ? (size_t)ncpus << 1 : 1;
+  if (n_arenas > MAX_ARENAS)
+    n_arenas = MAX_ARENAS;
+  for (size_t i = 0; i < MAX_ARENAS; i++)
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  pthread_key_create(&tcache_key, tcache_destroy);
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/// Bind the current thread to the least loaded arena, and register its cache
+/// so it is drained on thread exit
+static void tcache_register(TCache *cache)
+{
+  // The C library may allocate while we set up the thread, which comes back here
+  if (cache->registering)
+    return;
+  cache->registering = true;
+  pthread_once(&init_once, init);
+  static size_t next_arena = 0;
+  size_t start = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+  Arena *arena = &arenas[start % n_arenas];
+  for (size_t i = 1; i < n_arenas; i++)
+  {
+    Arena *other = &arenas[(start + i) % n_arenas];
+    if (__atomic_load_n(&other->nthreads, __ATOMIC_RELAXED) < __atomic_load_n(&arena->nthreads, __ATOMIC_RELAXED))
+      arena = other;
+  }
+  __atomic_fetch_add(&arena->nthreads, 1, __ATOMIC_RELAXED);
+  cache->arena = arena;
+  pthread_setspecific(tcache_key, cache);
+  pthread_mutex_lock(&stats_lock);
+  cache->next = registered_caches;
+  if (cache->next != NULL)
+    cache->next->prev = cache;
+  registered_caches = cache;
+  cache->registered = true;
+  pthread_mutex_unlock(&stats_lock);
+  cache->registering = false;
+}
+
+/// Lock the arena of the current thread
+static Arena *thread_arena_lock(void)
+{
+  if (!tcache.registered)
+    tcache_register(&tcache);
+  if (!tcache.registered)
+  {
+    // Still registering: use the first arena, which needs no setup
+    pthread_mutex_lock(&arenas[0].lock);
+    return &arenas[0];
+  }
+  return arena_lock(&tcache);
+}
+
+/// Refill a cache bin from the thread's arena. Returns false if out of memory.
+static bool tcache_refill(TCache *cache, size_t bin)
+{
+  Arena *arena = arena_lock(cache);
+  // Chain objects in allocation order, so they are handed out in address order
+  void *first = NULL;
+  void **last = &first;
+  size_t count = 0;
+  while (count < kTCacheBatchSize)
+  {
+    void *ptr;
+    if (bin < N_SLAB_CLASSES)
+    {
+      ptr = slab_alloc(arena, bin);
+    }
+    else
+    {
+      size_t sc = bin - N_SLAB_CLASSES;
+      bool zeroed;
+      Block *block = alloc_with_size_class(arena, sc, (sc + 1) * kAlignment, &zeroed);
+      ptr = block != NULL ? block_to_data(block) : NULL;
+    }
+    if (ptr == NULL)
+      break;
+    *last = ptr;
+    last = object_next(ptr);
+    count += 1;
+  }
+  pthread_mutex_unlock(&arena->lock);
+  *last = cache->bins[bin];
+  cache->bins[bin] = first;
+  cache->counts[bin] += count;
+  return count != 0;
+}
+
+/// Get the cache bin of an object, or N_TCACHE_BINS if it is not cached
+inline static size_t tcache_bin(ChunkKind kind, void *ptr)
+{
+  if (kind == kSlabChunk)
+    return object_to_slab(ptr)->size_class;
+  Block *block = data_to_block(ptr);
+  assert(!is_free(block));
+  return N_SLAB_CLASSES + size_class(get_block_size(block) - kBlockFixedMetadataSize);
+}
+
+/// Pop an object from a non-empty bin of the thread cache
+inline static void *tcache_pop(size_t bin)
+{
+  void *data = tcache.bins[bin];
+  tcache.bins[bin] = *object_next(data);
+  tcache.counts[bin] -= 1;
+  // Do not leak the link into the object
+  *object_next(data) = NULL;
+  return data;
+}
+
+/// Push an object to a bin of the thread cache
+inline static void tcache_push(size_t bin, void *ptr)
+{
+  *object_next(ptr) = tcache.bins[bin];
+  tcache.bins[bin] = ptr;
+  tcache.counts[bin] += 1;
+  if (tcache.counts[bin] > kTCacheMaxCount)
+    tcache_flush(&tcache, bin, kTCacheMaxCount >> 1);
+}
+#endif
+
+#ifdef ENABLE_TRACE
+// Events are buffered per thread, and written to the file named by $MYMALLOC_TRACE in batches
+#define TRACE_BUFFER_EVENTS 512
+
+typedef enum TraceState
+{
+  kTraceUnopened = 0,
+  kTraceOpening = 1,
+  kTraceOn = 2,
+  kTraceOff = 3, // No trace file, or a forked child
+} TraceState;
+
+typedef struct TraceBuffer
+{
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+  size_t count;
+  uint32_t thread;
+  bool registered;
+} TraceBuffer;
+
+static TraceState trace_state = kTraceUnopened;
+static int trace_fd = -1;
+static uint64_t trace_seq = 0;
+static uint64_t trace_start;
+static uint32_t trace_threads = 0;
+static pthread_key_t trace_key;
+static __thread TraceBuffer trace_buffer;
+
+/// Get the monotonic time in ns
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_flush(TraceBuffer *buffer)
+{
+  size_t bytes = buffer->count * sizeof(TraceEvent);
+  if (bytes != 0 && __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) == kTraceOn && write(trace_fd, buffer->events, bytes) != (ssize_t)bytes)
+    __atomic_store_n(&trace_state, kTraceOff, __ATOMIC_RELEASE);
+  buffer->count = 0;
+}
+
+/// Flush the events of an exiting thread
+static void trace_thread_exit(void *arg)
+{
+  trace_flush(arg);
+}
+
+/// Flush the events of the main thread, which does not run thread exit handlers
+__attribute__((destructor)) static void trace_exit(void)
+{
+  trace_flush(&trace_buffer);
+}
+
+/// The child of a fork has a different heap, so it stops recording
+static void trace_fork_child(void)
+{
+  trace_buffer.count = 0;
+  __atomic_store_n(&trace_state, kTraceOff, __ATOMIC_RELEASE);
+}
+
+static void trace_open(void)
+{
+  const char *path = getenv("MYMALLOC_TRACE");
+  trace_fd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644) : -1;
+  TraceHeader header = {.magic = TRACE_MAGIC, .event_size = sizeof(TraceEvent), .pid = (uint32_t)getpid()};
+  if (trace_fd < 0 || write(trace_fd, &header, sizeof(header)) != sizeof(header))
+  {
+    __atomic_store_n(&trace_state, kTraceOff, __ATOMIC_RELEASE);
+    return;
+  }
+  trace_start = now_ns();
+  pthread_key_create(&trace_key, trace_thread_exit);
+  __atomic_store_n(&trace_state, kTraceOn, __ATOMIC_RELEASE);
+  // May allocate, which is recorded
+  pthread_atfork(NULL, NULL, trace_fork_child);
+}
+
+/// Record an event. Frees are recorded before the object is released, and allocations after the
+/// object is taken, so that no thread can reuse an object before its free is ordered.
+static void trace_event(TraceOp op, void *ptr, size_t arg, size_t size)
+{
+  // Failed allocations and frees of NULL are not recorded
+  if (ptr == NULL)
+    return;
+  TraceState state = __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE);
+  if (state == kTraceUnopened && __atomic_compare_exchange_n(&trace_state, &state, kTraceOpening, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    trace_open();
+    state = __atomic_load_n(&trace_state, __ATOMIC_ACQUIRE);
+  }
+  // Events of other threads are dropped while the trace is being opened
+  if (state != kTraceOn)
+    return;
+  TraceBuffer *buffer = &trace_buffer;
+  if (!buffer->registered)
+  {
+    buffer->registered = true;
+    buffer->thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+    pthread_setspecific(trace_key, buffer);
+  }
+  TraceEvent *event = &buffer->events[buffer->count++];
+  event->seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+  event->time = now_ns() - trace_start;
+  event->ptr = (uint64_t)ptr;
+  event->arg = arg;
+  event->size = size;
+  event->thread = buffer->thread;
+  event->op = op;
+  if (buffer->count == TRACE_BUFFER_EVENTS)
+    trace_flush(buffer);
+}
+
+#define TRACE(op, ptr, arg, size) trace_event(op, ptr, (size_t)(arg), size)
+#else
+#define TRACE(op, ptr, arg, size)
+#endif
+
+#ifdef ENABLE_PROFILE
+/// Draw the bytes until the next sample of this thread, from an exponential distribution
+/// with a mean of `rate`
+static int64_t next_sample_interval(size_t rate)
+{
+  if (sample_seed == 0)
+    sample_seed = (((uint64_t)(size_t)&sample_seed) * 0x9e3779b97f4a7c15ull) ^ (uint64_t)time(NULL) ^ 1;
+  // xorshift64*
+  sample_seed ^= sample_seed >> 12;
+  sample_seed ^= sample_seed << 25;
+  sample_seed ^= sample_seed >> 27;
+  uint64_t q = ((sample_seed * 0x2545f4914f6cdd1dull) >> 38) + 1;
+  // The interval is -ln(u) * rate for a uniform u = q / 2^26 in (0, 1]. ln(q) = e ln(2) + ln(m) for
+  // q = m 2^e, with ln(m) = 2 atanh((m - 1) / (m + 1)) from the first terms of its series.
+  const double ln2 = 0.6931471805599453;
+  size_t e = find_last_set(q);
+  double m = (double)q / (double)(1ull << e);
+  double t = (m - 1) / (m + 1);
+  double t2 = t * t;
+  double ln_q = e * ln2 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+  return (int64_t)((26 * ln2 - ln_q) * rate) + 1;
+}
+
+static void profile_fork_prepare(void)
+{
+  pthread_mutex_lock(&profile_lock);
+}
+
+static void profile_fork_release(void)
+{
+  pthread_mutex_unlock(&profile_lock);
+}
+
+static void profile_init(void)
+{
+  pthread_atfork(profile_fork_prepare, profile_fork_release, profile_fork_release);
+  // The first backtrace loads the unwinder, which allocates
+  void *frame;
+  backtrace(&frame, 1);
+}
+
+/// Called when the countdown of this thread runs out: start the next one,
+/// and check if the allocation that ran it out is sampled
+static bool should_sample(void)
+{
+  if (sampling)
+    return false;
+  size_t rate = __atomic_load_n(&sample_rate, __ATOMIC_RELAXED);
+  if (rate == 0)
+  {
+    bytes_until_sample = kProfileRecheckBytes;
+    return false;
+  }
+  // The first countdown of a thread starts here
+  bool started = sample_seed != 0;
+  bytes_until_sample = next_sample_interval(rate);
+  return started;
+}
+
+/// Record the call stack of a sampled object
+__attribute__((noinline)) static void profile_sample(void *data, size_t size)
+{
+  if (data == NULL)
+    return;
+  sampling = true;
+  pthread_once(&profile_once, profile_init);
+  void *frames[PROFILE_MAX_FRAMES + kProfileSkipFrames];
+  int n_frames = backtrace(frames, PROFILE_MAX_FRAMES + kProfileSkipFrames);
+  sampling = false;
+  pthread_mutex_lock(&profile_lock);
+  Sample *sample = free_samples;
+  if (sample == NULL)
+  {
+    // Records come from their own pages, as the heap may be locked
+    const size_t n = kPageSize * 16 / sizeof(Sample);
+    Sample *records = mmap(NULL, n * sizeof(Sample), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (records == MAP_FAILED)
+    {
+      pthread_mutex_unlock(&profile_lock);
+      return;
+    }
+    COUNT(mmaps);
+    for (size_t i = 0; i < n; i++)
+      records[i].next = i + 1 < n ? &records[i + 1] : NULL;
+    sample = records;
+  }
+  free_samples = sample->next;
+  sample->ptr = data;
+  sample->size = size;
+  sample->n_frames = n_frames > (int)kProfileSkipFrames ? n_frames - kProfileSkipFrames : 0;
+  memcpy(sample->frames, frames + (n_frames - sample->n_frames), sample->n_frames * sizeof(void *));
+  put_sample(sample);
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// The unsampled path is a single countdown
+#define SAMPLED(size) ((bytes_until_sample -= (int64_t)(size)) < 0 && should_sample())
+#else
+#define SAMPLED(size) false
+#define profile_sample(data, size) ((void)0)
+#endif
+
+/// Allocate an object of a rounded up size from an arena, or NULL if out of memory
+static void *arena_alloc(Arena *arena, size_t size, bool *zeroed)
+{
+  if (size <= kSlabMaxSize)
+    return slab_alloc(arena, slab_class(size));
+  Block *block = alloc_with_size_class(arena, size_class(size), size, zeroed);
+  return block != NULL ? block_to_data(block) : NULL;
+}
+
+/// Allocate `n` objects of a rounded up size from an arena. Returns the number of objects allocated.
+static size_t arena_alloc_batch(Arena *arena, size_t size, size_t n, void **out)
+{
+  if (size <= kSlabMaxSize)
+    return slab_alloc_batch(arena, slab_class(size), n, out);
+  return alloc_block_batch(arena, size, n, out);
+}
+
+/// Allocate an object. `zeroed` is set if its data past kFreeMetadataSize bytes is known to be zero.
+static void *allocate(size_t size, bool *zeroed)
+{
+  *zeroed = false;
+  if (size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    // Fresh mappings are zero
+    *zeroed = true;
+    return huge_alloc(size, kMallocAlignment);
+  }
+  // Round up allocation size
+  size = size <= kSlabMaxSize ? size_align_up(size, kAlignment) : block_alloc_size(size);
+#ifdef ENABLE_THREADS
+  if (!tcache.registered)
+    tcache_register(&tcache);
+  size_t bin = size <= kSlabMaxSize ? slab_class(size) : N_SLAB_CLASSES + size_class(size);
+  if (bin < N_TCACHE_BINS && tcache.registered)
+  {
+    // Pop an object from the thread cache
+    if (tcache.bins[bin] == NULL && !tcache_refill(&tcache, bin))
+      return NULL;
+    return tcache_pop(bin);
+  }
+  Arena *arena = thread_arena_lock();
+  void *data = arena_alloc(arena, size, zeroed);
+  pthread_mutex_unlock(&arena->lock);
+  return data;
+#else
+  return arena_alloc(&arenas[0], size, zeroed);
+#endif
+}
+
+/// Allocate `n` objects of a size. Returns the number of objects allocated, fewer than `n` only if out of memory.
+static size_t allocate_batch(size_t size, size_t n, void **out)
+{
+  if (size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      if ((out[i] = huge_alloc(size, kMallocAlignment)) == NULL)
+        return i;
+    }
+    return n;
+  }
+  size = size <= kSlabMaxSize ? size_align_up(size, kAlignment) : block_alloc_size(size);
+#ifdef ENABLE_THREADS
+  if (!tcache.registered)
+    tcache_register(&tcache);
+  // Take the cached objects first, and the rest from the arena under one lock
+  size_t bin = size <= kSlabMaxSize ? slab_class(size) : N_SLAB_CLASSES + size_class(size);
+  size_t done = 0;
+  if (bin < N_TCACHE_BINS && tcache.registered)
+  {
+    for (; done < n && tcache.bins[bin] != NULL; done++)
+      out[done] = tcache_pop(bin);
+  }
+  if (done < n)
+  {
+    Arena *arena = thread_arena_lock();
+    done += arena_alloc_batch(arena, size, n - done, out + done);
+    pthread_mutex_unlock(&arena->lock);
+  }
+  return done;
+#else
+  return arena_alloc_batch(&arenas[0], size, n, out);
+#endif
+}
+
+void *my_malloc(size_t size)
+{
+  if (size == 0 || size > kMaxAllocationSize)
+    return NULL;
+  COUNT(mallocs);
+  INSTRUMENT_BEGIN(kMallocTCache);
+  bool zeroed;
+  void *data = allocate(size, &zeroed);
+  if (SAMPLED(size))
+    profile_sample(data, size);
+  INSTRUMENT_END();
+  LOG("alloc %p size=%zu\n", data, size);
+  TRACE(kTraceMalloc, data, 0, size);
+  return data;
+}
+
+size_t my_malloc_batch(size_t size, size_t n, void **out)
+{
+  if (size == 0 || size > kMaxAllocationSize)
+    return 0;
+  size_t done = allocate_batch(size, n, out);
+#ifdef ENABLE_PROFILE
+  // Each object counts towards sampling
+  for (size_t i = 0; i < done; i++)
+  {
+    if (SAMPLED(size))
+      profile_sample(out[i], size);
+  }
+#endif
+  COUNT_N(mallocs, done);
+  LOG("alloc_batch size=%zu n=%zu\n", size, done);
+#ifdef ENABLE_TRACE
+  for (size_t i = 0; i < done; i++)
+    TRACE(kTraceMalloc, out[i], 0, size);
+#endif
+  return done;
+}
+
+void *my_calloc(size_t count, size_t size)
+{
+  size_t total;
+  if (__builtin_mul_overflow(count, size, &total) || total == 0 || total > kMaxAllocationSize)
+    return NULL;
+  COUNT(mallocs);
+  bool zeroed;
+  void *data = allocate(total, &zeroed);
+  if (data == NULL)
+    return NULL;
+  if (SAMPLED(total))
+    profile_sample(data, total);
+  // Only clear what may be dirty
+  memset(data, 0, zeroed && total > kFreeMetadataSize ? kFreeMetadataSize : total);
+  LOG("calloc %p size=%zu zeroed=%d\n", data, total, zeroed);
+  TRACE(kTraceCalloc, data, 0, total);
+  return data;
+}
+
+/// Release an object to its arena
+static void free_object(void *ptr)
+{
+  size_t entry = chunk_entry(ptr);
+  if (entry_kind(entry) == kHugeChunk)
+  {
+    huge_free(ptr);
+    return;
+  }
+#ifdef ENABLE_THREADS
+  size_t bin = tcache_bin(entry_kind(entry), ptr);
+  if (bin < N_TCACHE_BINS && tcache.registered)
+  {
+    tcache_push(bin, ptr);
+    return;
+  }
+  // Free into the arena owning the object, which may not be the arena of this thread
+  Arena *arena = entry_arena(entry);
+  if (is_remote_free(&tcache, arena))
+  {
+    if (remote_free(arena, ptr, ptr))
+      drain_orphaned_arena(arena);
+    return;
+  }
+  pthread_mutex_lock(&arena->lock);
+  arena_free(arena, entry_kind(entry), ptr);
+  pthread_mutex_unlock(&arena->lock);
+#else
+  arena_free(entry_arena(entry), entry_kind(entry), ptr);
+#endif
+}
+
+void my_free(void *ptr)
+{
+  if (ptr == NULL)
+    return;
+  COUNT(frees);
+  LOG("free %p\n", ptr);
+  TRACE(kTraceFree, ptr, 0, 0);
+  INSTRUMENT_BEGIN(kFreeTCache);
+  unsample(ptr);
+  free_object(ptr);
+  INSTRUMENT_END();
+}
+
+/// Free a small object of a known size without looking up its chunk, as its size gives its slab class.
+/// Returns false if the object is not known to be small.
+inline static bool free_small_object(void *ptr, size_t size)
+{
+#ifdef ENABLE_THREADS
+  if (size == 0 || size > kSlabMaxSize || !tcache.registered)
+    return false;
+  tcache_push(slab_class(size_align_up(size, kAlignment)), ptr);
+  return true;
+#else
+  if (size == 0 || size > kSlabMaxSize)
+    return false;
+  slab_free(&arenas[0], ptr);
+  return true;
+#endif
+}
+
+#ifdef ENABLE_CHECK_FREE_SIZE
+/// Check the size passed to my_free_sized against the object: it must fit the object,
+/// and a small size must give the slab class of the object
+static void check_free_size(void *ptr, size_t size)
+{
+  size_t entry = chunk_entry(ptr);
+  assert(size != 0 && size <= object_size(entry, ptr));
+  if (size <= kSlabMaxSize)
+    assert(entry_kind(entry) == kSlabChunk && object_to_slab(ptr)->size_class == slab_class(size_align_up(size, kAlignment)));
+}
+#endif
+
+void my_free_sized(void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    return;
+#ifdef ENABLE_CHECK_FREE_SIZE
+  check_free_size(ptr, size);
+#endif
+  COUNT(frees);
+  LOG("free_sized %p size=%zu\n", ptr, size);
+  TRACE(kTraceFree, ptr, 0, 0);
+  INSTRUMENT_BEGIN(kFreeTCache);
+  unsample(ptr);
+  if (!free_small_object(ptr, size))
+    free_object(ptr);
+  INSTRUMENT_END();
+}
+
+/// Sort pointers by address with a heap sort
+static void heap_sort_pointers(void **ptrs, size_t n)
+{
+  for (size_t end = n, start = n / 2; end > 1;)
+  {
+    // Build the max-heap, then move its root past its end
+    if (start > 0)
+    {
+      start -= 1;
+    }
+    else
+    {
+      end -= 1;
+      void *root = ptrs[0];
+      ptrs[0] = ptrs[end];
+      ptrs[end] = root;
+    }
+    for (size_t parent = start, child; (child = 2 * parent + 1) < end; parent = child)
+    {
+      if (child + 1 < end && ptrs[child + 1] > ptrs[child])
+        child += 1;
+      if (ptrs[parent] >= ptrs[child])
+        break;
+      void *tmp = ptrs[parent];
+      ptrs[parent] = ptrs[child];
+      ptrs[child] = tmp;
+    }
+  }
+}
+
+/// Sort pointers by address in place, as the allocator cannot allocate to sort. Quicksort partitions
+/// around medians of three, and falls back to a heap sort when partitions keep being lopsided.
+static void sort_pointers(void **ptrs, size_t n, size_t depth)
+{
+  while (n > 16)
+  {
+    if (depth == 0)
+    {
+      heap_sort_pointers(ptrs, n);
+      return;
+    }
+    depth -= 1;
+    void *a = ptrs[0], *b = ptrs[n / 2], *c = ptrs[n - 1];
+    void *pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+    size_t i = 0, j = n - 1;
+    for (;;)
+    {
+      while (ptrs[i] < pivot)
+        i++;
+      while (ptrs[j] > pivot)
+        j--;
+      if (i >= j)
+        break;
+      void *tmp = ptrs[i];
+      ptrs[i++] = ptrs[j];
+      ptrs[j--] = tmp;
+    }
+    // Recurse into the smaller side, so the stack stays logarithmic
+    if (j + 1 < n - j - 1)
+    {
+      sort_pointers(ptrs, j + 1, depth);
+      ptrs += j + 1;
+      n -= j + 1;
+    }
+    else
+    {
+      sort_pointers(ptrs + j + 1, n - j - 1, depth);
+      n = j + 1;
+    }
+  }
+  for (size_t i = 1; i < n; i++)
+  {
+    void *ptr = ptrs[i];
+    size_t j = i;
+    for (; j > 0 && ptrs[j - 1] > ptr; j--)
+      ptrs[j] = ptrs[j - 1];
+    ptrs[j] = ptr;
+  }
+}
+
+/// Merge a run of sorted objects into the block of the first one, while their blocks are adjacent.
+/// Returns the number of objects merged.
+static size_t merge_block_run(Arena *arena, Block *block, void **ptrs, size_t n)
+{
+  size_t merged = 0;
+  for (; merged < n; merged++)
+  {
+    Block *right = get_right_block(block);
+    if (is_fence(right) || ptrs[merged] != block_to_data(right) || get_block_size(block) + get_block_size(right) > kMaxBlockSize)
+      break;
+    assert(!is_free(right));
+    TRACE(kTraceFree, ptrs[merged], 0, 0);
+    COUNT(coalesces);
+    set_block_size(block, get_block_size(block) + get_block_size(right));
+    if (right == arena->top_block)
+      arena->top_block = block;
+  }
+  return merged;
+}
+
+/// Release the arena lock of a batch, if it holds one
+inline static void batch_unlock(Arena **locked)
+{
+#ifdef ENABLE_THREADS
+  if (*locked != NULL)
+    pthread_mutex_unlock(&(*locked)->lock);
+#endif
+  *locked = NULL;
+}
+
+/// Lock the arena of the next object of a batch, keeping the lock of the previous one if it is the same
+inline static void batch_lock(Arena **locked, Arena *arena)
+{
+#ifdef ENABLE_THREADS
+  if (arena == *locked)
+    return;
+  batch_unlock(locked);
+  pthread_mutex_lock(&arena->lock);
+#endif
+  *locked = arena;
+}
+
+void my_free_batch(void **ptrs, size_t n)
+{
+  // Blocks are moved to the front, to be freed in address order. The other objects are freed as they come.
+  Arena *locked = NULL;
+  size_t blocks = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    void *ptr = ptrs[i];
+    if (ptr == NULL)
+      continue;
+    COUNT(frees);
+    unsample(ptr);
+    size_t entry = chunk_entry(ptr);
+    Arena *arena = entry_arena(entry);
+#ifdef ENABLE_THREADS
+    bool remote = entry_kind(entry) != kHugeChunk && is_remote_free(&tcache, arena);
+#else
+    bool remote = false;
+#endif
+    if (entry_kind(entry) == kBlockChunk && !remote)
+    {
+      ptrs[blocks++] = ptr;
+      continue;
+    }
+    TRACE(kTraceFree, ptr, 0, 0);
+    if (entry_kind(entry) == kSlabChunk && !remote)
+    {
+      batch_lock(&locked, arena);
+      slab_free(arena, ptr);
+    }
+    else
+    {
+      // Huge objects, and objects of other threads' arenas, take no lock. They may go to the thread
+      // cache, whose flush locks the arena of this thread, so the lock of the batch is released first.
+      batch_unlock(&locked);
+      free_object(ptr);
+    }
+  }
+  sort_pointers(ptrs, blocks, 2 * find_last_set(blocks | 1));
+  for (size_t i = 0; i < blocks; i++)
+  {
+    TRACE(kTraceFree, ptrs[i], 0, 0);
+    Arena *arena = entry_arena(chunk_entry(ptrs[i]));
+    batch_lock(&locked, arena);
+    // Adjacent blocks are merged, and freed as one block
+    Block *block = data_to_block(ptrs[i]);
+    i += merge_block_run(arena, block, ptrs + i + 1, blocks - i - 1);
+    free_block(arena, block);
+  }
+  batch_unlock(&locked);
+  LOG("free_batch n=%zu\n", n);
+}
+
+void *my_aligned_alloc(size_t alignment, size_t size)
+{
+  if (size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > kMaxAllocationSize || size > kMaxAllocationSize - alignment)
+    return NULL;
+  if (alignment <= kAlignment || (alignment <= kMallocAlignment && size > kAlignment))
+    return my_malloc(size);
+  COUNT(mallocs);
+  void *data;
+  bool zeroed;
+  size_t sc = N_SLAB_CLASSES;
+  if (size <= kSlabMaxSize && kSlabHeaderSize % alignment == 0)
+  {
+    // Slab objects are aligned to their size class if the page header is
+    for (sc = slab_class(size_align_up(size, kAlignment)); sc < N_SLAB_CLASSES && kSlabClassSizes[sc] % alignment != 0; sc++)
+      ;
+  }
+  if (sc < N_SLAB_CLASSES)
+  {
+    data = allocate(kSlabClassSizes[sc], &zeroed);
+  }
+  else if (size + alignment + kBlockMetadataSize > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    data = huge_alloc(size, alignment);
+  }
+  else
+  {
+    size_t block_size = block_alloc_size(size);
+#ifdef ENABLE_THREADS
+    Arena *arena = thread_arena_lock();
+    Block *block = alloc_aligned_block(arena, block_size, alignment);
+    pthread_mutex_unlock(&arena->lock);
+#else
+    Block *block = alloc_aligned_block(&arenas[0], block_size, alignment);
+#endif
+    data = block != NULL ? block_to_data(block) : NULL;
+  }
+  if (SAMPLED(size))
+    profile_sample(data, size);
+  LOG("aligned_alloc %p size=%zu alignment=%zu\n", data, size, alignment);
+  TRACE(kTraceAlignedAlloc, data, alignment, size);
+  return data;
+}
+
+int my_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  if (size == 0)
+  {
+    *memptr = NULL;
+    return 0;
+  }
+  void *data = my_aligned_alloc(alignment, size);
+  if (data == NULL)
+    return ENOMEM;
+  *memptr = data;
+  return 0;
+}
+
+void my_set_purge_decay(size_t decay_ms)
+{
+  __atomic_store_n(&purge_decay, decay_ms, __ATOMIC_RELAXED);
+}
+
+/// Resize an object, in place if possible
+static void *reallocate(void *ptr, size_t size)
+{
+  size_t entry = chunk_entry(ptr);
+  if (entry_kind(entry) == kHugeChunk && size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    void *data = huge_realloc(ptr, size);
+    if (data != NULL)
+      resample(ptr, data, size);
+    return data;
+  }
+  // Small objects stay in place only if they keep their slab size class
+  bool is_small = size <= kSlabMaxSize;
+  if (is_small == (entry_kind(entry) == kSlabChunk) &&
+      (!is_small || slab_class(size_align_up(size, kAlignment)) == object_to_slab(ptr)->size_class) &&
+      resize_in_place(entry, ptr, size, size) != 0)
+  {
+    resample(ptr, ptr, size);
+    return ptr;
+  }
+  // Move the object, and its sample with it
+  size_t old_size = object_size(entry, ptr);
+  bool zeroed;
+  void *data = allocate(size, &zeroed);
+  if (data == NULL)
+    return NULL;
+  memcpy(data, ptr, old_size < size ? old_size : size);
+  resample(ptr, data, size);
+  free_object(ptr);
+  return data;
+}
+
+void *my_realloc(void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    return my_malloc(size);
+  if (size == 0)
+  {
+    my_free(ptr);
+    return NULL;
+  }
+  if (size > kMaxAllocationSize)
+    return NULL;
+  COUNT(reallocs);
+  LOG("realloc %p size=%zu\n", ptr, size);
+  void *data = reallocate(ptr, size);
+  TRACE(kTraceRealloc, data, ptr, size);
+  return data;
+}
+
+size_t my_try_expand(void *ptr, size_t min, size_t max)
+{
+  if (ptr == NULL || min > kMaxAllocationSize)
+    return 0;
+  LOG("try_expand %p min=%zu max=%zu\n", ptr, min, max);
+  size_t size = resize_in_place(chunk_entry(ptr), ptr, min, max < min ? min : (max > kMaxAllocationSize ? kMaxAllocationSize : max));
+  if (size != 0)
+    resample(ptr, ptr, size);
+  // Recorded as a realloc that does not move the object
+  TRACE(kTraceRealloc, size != 0 ? ptr : NULL, ptr, size);
+  return size;
+}
+
+size_t my_malloc_usable_size(void *ptr)
+{
+  if (ptr == NULL)
+    return 0;
+  return object_size(chunk_entry(ptr), ptr);
+}
+
+/// Size of the largest free block of an arena
+static size_t largest_free_block(Arena *arena)
+{
+  if (arena->treemap != 0)
+  {
+    // Blocks of a right subtree are larger than those of its left sibling, but not than their parents
+    size_t largest = 0;
+    for (TreeBlock *t = arena->trees[find_last_set(arena->treemap)]; t != NULL; t = t->child[1] != NULL ? t->child[1] : t->child[0])
+      largest = max(largest, get_block_size(&t->block));
+    return largest;
+  }
+  // Blocks of a list all have the same size
+  for (size_t sc = N_LISTS; sc-- > 0;)
+  {
+    if (arena->lists[sc] != NULL)
+      return get_block_size(arena->lists[sc]);
+  }
+  return 0;
+}
+
+void my_malloc_stats(MallocStats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  size_t n = 1;
+#ifdef ENABLE_THREADS
+  pthread_once(&init_once, init);
+  n = n_arenas;
+#endif
+  for (size_t i = 0; i < n; i++)
+  {
+    Arena *arena = &arenas[i];
+#ifdef ENABLE_THREADS
+    pthread_mutex_lock(&arena->lock);
+#endif
+    stats->mapped += arena->mapped;
+    stats->in_use += arena->live;
+    stats->chunks += arena->chunks;
+    for (size_t sc = 0; sc <= N_LISTS; sc++)
+    {
+      stats->free_by_class[sc] += arena->free_bytes[sc];
+      stats->free += arena->free_bytes[sc];
+    }
+    stats->largest_free = max(stats->largest_free, largest_free_block(arena));
+#ifdef ENABLE_THREADS
+    pthread_mutex_unlock(&arena->lock);
+#endif
+  }
+  stats->huge_mappings = __atomic_load_n(&huge_count, __ATOMIC_RELAXED);
+  stats->mapped += __atomic_load_n(&huge_mapped, __ATOMIC_RELAXED);
+  stats->in_use += __atomic_load_n(&huge_mapped, __ATOMIC_RELAXED);
+  Counters total;
+#ifdef ENABLE_THREADS
+  memset(&total, 0, sizeof(total));
+  pthread_mutex_lock(&stats_lock);
+  add_counters(&total, &retired_counters);
+  for (TCache *cache = registered_caches; cache != NULL; cache = cache->next)
+    add_counters(&total, &cache->counters);
+  pthread_mutex_unlock(&stats_lock);
+#else
+  total = counters;
+#endif
+  stats->mallocs = total.mallocs;
+  stats->frees = total.frees;
+  stats->reallocs = total.reallocs;
+  stats->splits = total.splits;
+  stats->coalesces = total.coalesces;
+  stats->mmaps = total.mmaps;
+  stats->munmaps = total.munmaps;
+}
+
+/// Text dump being written to a file descriptor
+typedef struct TextWriter
+{
+  int fd;
+  size_t length;
+  char buf[4096];
+  bool failed;
+} TextWriter;
+
+/// Write out the buffered lines of the dump
+static void text_flush(TextWriter *writer)
+{
+  for (size_t done = 0; done < writer->length && !writer->failed;)
+  {
+    ssize_t n = write(writer->fd, writer->buf + done, writer->length - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    writer->failed = n <= 0;
+    done += n > 0 ? (size_t)n : 0;
+  }
+  writer->length = 0;
+}
+
+/// Append a line to the dump, and write out the buffer when it is full
+static void text_printf(TextWriter *writer, const char *format, ...)
+{
+  va_list args;
+  for (size_t attempt = 0; attempt < 2; attempt++)
+  {
+    va_start(args, format);
+    int n = vsnprintf(writer->buf + writer->length, sizeof(writer->buf) - writer->length, format, args);
+    va_end(args);
+    if (n >= 0 && writer->length + n < sizeof(writer->buf))
+    {
+      writer->length += n;
+      return;
+    }
+    text_flush(writer);
+  }
+}
+
+/// Dump a metric without labels
+static void stats_metric(TextWriter *writer, const char *name, const char *type, const char *help, size_t value)
+{
+  text_printf(writer, "# HELP mymalloc_%s %s\n# TYPE mymalloc_%s %s\nmymalloc_%s %zu\n", name, help, name, type, name, value);
+}
+
+int my_malloc_stats_print(int fd)
+{
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  // Allocated from the stack: the dump must not allocate
+  TextWriter writer = {.fd = fd, .length = 0, .failed = false};
+  stats_metric(&writer, "mapped_bytes", "gauge", "Bytes mapped from the OS", stats.mapped);
+  stats_metric(&writer, "in_use_bytes", "gauge", "Bytes of allocated blocks, slab objects and huge mappings", stats.in_use);
+  stats_metric(&writer, "free_bytes", "gauge", "Bytes of free blocks", stats.free);
+  stats_metric(&writer, "largest_free_bytes", "gauge", "Size of the largest free block", stats.largest_free);
+  stats_metric(&writer, "chunks", "gauge", "Chunks of the arenas", stats.chunks);
+  stats_metric(&writer, "huge_mappings", "gauge", "Dedicated mappings of huge allocations", stats.huge_mappings);
+  stats_metric(&writer, "mallocs_total", "counter", "Allocations", stats.mallocs);
+  stats_metric(&writer, "frees_total", "counter", "Frees", stats.frees);
+  stats_metric(&writer, "reallocs_total", "counter", "Reallocations", stats.reallocs);
+  stats_metric(&writer, "splits_total", "counter", "Free blocks split to serve an allocation", stats.splits);
+  stats_metric(&writer, "coalesces_total", "counter", "Free blocks merged with a neighbour", stats.coalesces);
+  stats_metric(&writer, "mmaps_total", "counter", "Calls to mmap and mremap", stats.mmaps);
+  stats_metric(&writer, "munmaps_total", "counter", "Calls to munmap", stats.munmaps);
+  text_printf(&writer, "# HELP mymalloc_class_free_bytes Bytes of free blocks per size class\n# TYPE mymalloc_class_free_bytes gauge\n");
+  for (size_t sc = 0; sc < N_LISTS; sc++)
+    text_printf(&writer, "mymalloc_class_free_bytes{size=\"%zu\"} %zu\n", (sc + 1) * kAlignment, stats.free_by_class[sc]);
+  text_printf(&writer, "mymalloc_class_free_bytes{size=\"general\"} %zu\n", stats.free_by_class[N_LISTS]);
+  text_flush(&writer);
+  return writer.failed ? -1 : 0;
+}
+
+/// Report the blocks of a run of merged block chunks, from its first chunk. Returns the end of the run.
+static size_t walk_blocks(Arena *arena, size_t chunk, HeapWalkCallback callback, void *arg)
+{
+  assert(is_fence((Block *)chunk));
+  Block *block = (Block *)(chunk + kFenceSize);
+  for (; !is_fence(block); block = get_right_block(block))
+  {
+    HeapEntry entry = {.kind = kHeapBlock, .start = block, .size = get_block_size(block), .usable = block_usable_size(block), .free = is_free(block), .arena = (size_t)(arena - arenas)};
+    callback(&entry, arg);
+  }
+  return ((size_t)block) + kFenceSize;
+}
+
+/// Report the slab pages of a slab chunk that were carved out
+static void walk_slab_pages(Arena *arena, size_t chunk, size_t size, HeapWalkCallback callback, void *arg)
+{
+  size_t end = arena->slab_cursor > chunk && arena->slab_cursor <= chunk + size ? arena->slab_cursor : chunk + size;
+  for (size_t addr = chunk; addr < end; addr += kSlabPageSize)
+  {
+    SlabPage *page = (SlabPage *)addr;
+    HeapEntry entry = {.kind = kHeapSlabPage, .start = page, .size = kSlabPageSize, .usable = page->object_size, .free = page->n_free == page->n_objects, .n_objects = page->n_objects, .n_free = page->n_free, .arena = (size_t)(arena - arenas)};
+    callback(&entry, arg);
+  }
+}
+
+void my_heap_walk(HeapWalkCallback callback, void *arg)
+{
+  size_t n = 1;
+#ifdef ENABLE_THREADS
+  pthread_once(&init_once, init);
+  n = n_arenas;
+  for (size_t i = 0; i < n; i++)
+    pthread_mutex_lock(&arenas[i].lock);
+#endif
+  // Chunks merged into the run of blocks of a chunk below them have no fence at their start.
+  // Walking in address order, they are covered by the run of that chunk.
+  size_t covered = 0;
+  for (size_t root = 0; root < (1ull << CHUNK_MAP_ROOT_BITS); root++)
+  {
+    ChunkInfo *leaves = __atomic_load_n(&chunk_map[root], __ATOMIC_ACQUIRE);
+    for (size_t leaf = 0; leaves != NULL && leaf < (1ull << CHUNK_MAP_LEAF_BITS); leaf++)
+    {
+      ChunkInfo *info = &leaves[leaf];
+      size_t chunk = ((root << CHUNK_MAP_LEAF_BITS) | leaf) << CHUNK_SHIFT;
+      // Only the first granule of a chunk of an arena reports it
+      size_t kind = entry_kind(info->entry);
+      Arena *arena = entry_arena(info->entry);
+      if (kind == kHugeChunk || arena == NULL || info->start != chunk)
+        continue;
+      HeapEntry entry = {.kind = kind == kSlabChunk ? kHeapSlabChunk : kHeapBlockChunk, .start = (void *)chunk, .size = info->size, .arena = (size_t)(arena - arenas)};
+      callback(&entry, arg);
+      if (kind == kSlabChunk)
+        walk_slab_pages(arena, chunk, info->size, callback, arg);
+      else if (chunk >= covered)
+        covered = walk_blocks(arena, chunk, callback, arg);
+    }
+  }
+#ifdef ENABLE_THREADS
+  for (size_t i = 0; i < n; i++)
+    pthread_mutex_unlock(&arenas[i].lock);
+#endif
+  USE(n);
+}
+
+#ifdef ENABLE_PROFILE
+void my_set_sample_rate(size_t bytes)
+{
+  __atomic_store_n(&sample_rate, bytes, __ATOMIC_RELAXED);
+}
+
+int my_heap_profile_dump(int fd)
+{
+  TextWriter writer = {.fd = fd, .length = 0, .failed = false};
+  pthread_mutex_lock(&profile_lock);
+  size_t count = 0, bytes = 0;
+  for (size_t i = 0; i < (1 << SAMPLE_BUCKET_BITS); i++)
+  {
+    for (Sample *sample = sample_buckets[i]; sample != NULL; sample = sample->next)
+    {
+      count += 1;
+      bytes += sample->size;
+    }
+  }
+  // Legacy heap profile of gperftools, which pprof reads. Each line is a live sample.
+  text_printf(&writer, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", count, bytes, count, bytes, __atomic_load_n(&sample_rate, __ATOMIC_RELAXED));
+  for (size_t i = 0; i < (1 << SAMPLE_BUCKET_BITS); i++)
+  {
+    for (Sample *sample = sample_buckets[i]; sample != NULL; sample = sample->next)
+    {
+      text_printf(&writer, "1: %zu [1: %zu] @", sample->size, sample->size);
+      for (size_t j = 0; j < sample->n_frames; j++)
+        text_printf(&writer, " %p", sample->frames[j]);
+      text_printf(&writer, "\n");
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+  // pprof symbolizes the stacks with the mappings of the process
+  text_printf(&writer, "\nMAPPED_LIBRARIES:\n");
+  text_flush(&writer);
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps >= 0)
+  {
+    ssize_t n;
+    while ((n = read(maps, writer.buf, sizeof(writer.buf))) > 0)
+    {
+      writer.length = n;
+      text_flush(&writer);
+    }
+    close(maps);
+  }
+  return writer.failed ? -1 : 0;
+}
+#else
+void my_set_sample_rate(size_t bytes)
+{
+  USE(bytes);
+}
+
+int my_heap_profile_dump(int fd)
+{
+  USE(fd);
+  return -1;
+}
+#endif
+
+#ifdef ENABLE_INSTRUMENT
+static const char *const kHistogramNames[N_HISTOGRAMS] = {
+    "malloc_tcache", "malloc_slab", "malloc_list", "malloc_larger_list", "malloc_tree", "malloc_chunk", "malloc_huge",
+    "free_tcache", "free_remote", "free_slab", "free_block", "free_flush", "free_release", "free_huge",
+    "tree_nodes", "classes_skipped",
+};
+
+/// Get the value under which `permille` thousandths of the values of a histogram fall
+static uint64_t histogram_percentile(const Histogram *histogram, uint64_t total, uint64_t permille)
+{
+  uint64_t rank = (total * permille + 999) / 1000;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < N_BUCKETS; b++)
+  {
+    seen += histogram->counts[b];
+    if (seen >= rank)
+    {
+      uint64_t limit = histogram_bucket_limit(b);
+      return limit < histogram->max ? limit : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+int my_malloc_latency_print(int fd)
+{
+  // Summed under the lock, which guards this static
+  static Histogram totals[N_HISTOGRAMS];
+  TextWriter writer = {.fd = fd, .length = 0, .failed = false};
+  pthread_mutex_lock(&instrument_lock);
+  memcpy(totals, retired_histograms, sizeof(totals));
+  for (Instrument *state = registered_instruments; state != NULL; state = state->next)
+  {
+    for (size_t h = 0; h < N_HISTOGRAMS; h++)
+    {
+      for (size_t b = 0; b < N_BUCKETS; b++)
+        totals[h].counts[b] += __atomic_load_n(&state->histograms[h].counts[b], __ATOMIC_RELAXED);
+      totals[h].max = max(totals[h].max, __atomic_load_n(&state->histograms[h].max, __ATOMIC_RELAXED));
+    }
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  text_printf(&writer, "%-20s %12s %10s %10s %10s %10s  (cycles)\n", "path", "calls", "p50", "p99", "p99.9", "max");
+#else
+  text_printf(&writer, "%-20s %12s %10s %10s %10s %10s  (ns)\n", "path", "calls", "p50", "p99", "p99.9", "max");
+#endif
+  for (size_t h = 0; h < N_HISTOGRAMS; h++)
+  {
+    if (h == HISTOGRAM_TREE_NODES)
+      text_printf(&writer, "\n%-20s %12s %10s %10s %10s %10s\n", "lookup", "lookups", "p50", "p99", "p99.9", "max");
+    uint64_t total = 0;
+    for (size_t b = 0; b < N_BUCKETS; b++)
+      total += totals[h].counts[b];
+    // Paths never taken are left out
+    if (total == 0 && h < N_PATHS)
+      continue;
+    text_printf(&writer, "%-20s %12" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", kHistogramNames[h], total,
+                histogram_percentile(&totals[h], total, 500), histogram_percentile(&totals[h], total, 990),
+                histogram_percentile(&totals[h], total, 999), totals[h].max);
+  }
+  pthread_mutex_unlock(&instrument_lock);
+  text_flush(&writer);
+  return writer.failed ? -1 : 0;
+}
+
+/// Report the histograms into the file named by $MYMALLOC_INSTRUMENT at exit
+__attribute__((destructor)) static void instrument_exit(void)
+{
+  const char *path = getenv("MYMALLOC_INSTRUMENT");
+  int fd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+  if (fd < 0)
+    return;
+  my_malloc_latency_print(fd);
+  close(fd);
+}
+#else
+int my_malloc_latency_print(int fd)
+{
+  USE(fd);
+  return -1;
 }
+#endif
@@ -0,0 +1,364 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "mymalloc.h"
+
+typedef struct Block
+{
+  size_t size : 32;
+  size_t left_size : 31;
+  size_t free : 1;
+  struct Block *prev;
+  struct Block *next;
+} Block;
+
+// Two-level segregated fit: the first level splits sizes by power of two, and the second level
+// splits each power of two range linearly into 2^SL_INDEX_BITS lists.
+#define SL_INDEX_BITS 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_BITS)
+#define ALIGNMENT_BITS 3
+#define FL_INDEX_SHIFT (SL_INDEX_BITS + ALIGNMENT_BITS)
+#define FL_INDEX_MAX 32 // Block sizes are 32-bit
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+
+const size_t kBlockMetadataSize = sizeof(Block);
+const size_t kBlockFixedMetadataSize = offsetof(Block, prev);
+const size_t kChunkSize = 16ull << 20; // 16MB mmap chunk
+const size_t kFenceSize = sizeof(size_t);
+const size_t kMaxAllocationSize = kChunkSize - kBlockMetadataSize - (kFenceSize << 1); // We support allocation up to ~16MB
+
+static const size_t kAlignment = sizeof(size_t); // Word alignment
+static const size_t kMinAllocationSize = kAlignment;
+static const size_t kFenceValue = 0xdeadbeef;
+static const size_t kSmallBlockSize = 1 << FL_INDEX_SHIFT; // Sizes below this live in the first level 0
+static const size_t kMaxBlockSize = (1ull << 31) - kAlignment; // Blocks merged across chunks must fit left_size (2GB)
+
+static Block *lists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+static uint32_t fl_bitmap;                 // Bit i is set if any list of first level i is not empty
+static uint32_t sl_bitmap[FL_INDEX_COUNT]; // Bit j is set if lists[i][j] is not empty
+
+static void *top = NULL;
+static Block *top_block = NULL;
+
+static void *bottom = NULL;
+static Block *bottom_block = NULL;
+
+inline static size_t max(size_t a, size_t b)
+{
+  return a >= b ? a : b;
+}
+
+/// Index of the most significant set bit
+inline static size_t find_last_set(size_t x)
+{
+  assert(x != 0);
+  return (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(x);
+}
+
+/// Index of the least significant set bit
+inline static size_t find_first_set(uint32_t x)
+{
+  assert(x != 0);
+  return __builtin_ctz(x);
+}
+
+/// Get the list indices of a block size
+inline static void mapping_insert(size_t size, size_t *fl, size_t *sl)
+{
+  if (size < kSmallBlockSize)
+  {
+    *fl = 0;
+    *sl = size / (kSmallBlockSize / SL_INDEX_COUNT);
+  }
+  else
+  {
+    size_t bit = find_last_set(size);
+    *sl = (size >> (bit - SL_INDEX_BITS)) ^ (1 << SL_INDEX_BITS);
+    *fl = bit - (FL_INDEX_SHIFT - 1);
+  }
+}
+
+/// Get the indices of the first list whose blocks all fit a block size
+inline static void mapping_search(size_t size, size_t *fl, size_t *sl)
+{
+  if (size >= kSmallBlockSize)
+    size += (1ull << (find_last_set(size) - SL_INDEX_BITS)) - 1;
+  mapping_insert(size, fl, sl);
+}
+
+/// Get right neighbour
+inline static Block *get_right_block(Block *block)
+{
+  return (Block *)(((size_t)block) + block->size);
+}
+
+/// Get left neighbour
+inline static Block *get_left_block(Block *block)
+{
+  return (Block *)(((size_t)block) - block->left_size);
+}
+
+/// Round up size
+inline static size_t size_align_up(size_t size, size_t alignment)
+{
+  const size_t mask = alignment - 1;
+  return (size + mask) & ~mask;
+}
+
+/// Get data pointer of a block
+inline static void *block_to_data(Block *block)
+{
+  return (void *)(((size_t)block) + kBlockFixedMetadataSize);
+}
+
+/// Get the block of the data pointer
+inline static Block *data_to_block(void *ptr)
+{
+  return (Block *)(((size_t)ptr) - kBlockFixedMetadataSize);
+}
+
+/// Add block to the freelist
+static void add_block(Block *block)
+{
+  assert(block->size >= kBlockMetadataSize);
+  size_t fl, sl;
+  mapping_insert(block->size, &fl, &sl);
+  block->prev = NULL;
+  block->next = lists[fl][sl];
+  if (lists[fl][sl] != NULL)
+    lists[fl][sl]->prev = block;
+  lists[fl][sl] = block;
+  fl_bitmap |= 1u << fl;
+  sl_bitmap[fl] |= 1u << sl;
+}
+
+/// Remove block from the freelist
+static void remove_block(Block *block)
+{
+  assert(block->size >= kBlockMetadataSize);
+  size_t fl, sl;
+  mapping_insert(block->size, &fl, &sl);
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+  if (lists[fl][sl] == block)
+  {
+    lists[fl][sl] = block->next;
+    if (lists[fl][sl] == NULL)
+    {
+      sl_bitmap[fl] &= ~(1u << sl);
+      if (sl_bitmap[fl] == 0)
+        fl_bitmap &= ~(1u << fl);
+    }
+  }
+  block->next = NULL;
+  block->prev = NULL;
+}
+
+/// Find a free block of at least `size` bytes in constant time
+static Block *find_suitable_block(size_t size)
+{
+  size_t fl, sl;
+  mapping_search(size, &fl, &sl);
+  if (fl >= FL_INDEX_COUNT)
+    return NULL;
+  // Try the remaining lists of the same first level
+  uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+  if (sl_map == 0)
+  {
+    // Try the next non-empty first level
+    uint32_t fl_map = fl + 1 < FL_INDEX_COUNT ? fl_bitmap & (~0u << (fl + 1)) : 0;
+    if (fl_map == 0)
+      return NULL;
+    fl = find_first_set(fl_map);
+    sl_map = sl_bitmap[fl];
+  }
+  sl = find_first_set(sl_map);
+  Block *block = lists[fl][sl];
+  assert(block != NULL && block->size >= size);
+  return block;
+}
+
+/// Check if we're touching a fence
+inline static bool is_fence(Block *block)
+{
+  return *((size_t *)block) == kFenceValue;
+}
+
+/// Acquire more memory from OS
+static Block *acquire_more_memory(size_t alloc_size)
+{
+  assert(alloc_size + kBlockMetadataSize + (kFenceSize << 1) <= kChunkSize);
+  // Acquire one more chunk from OS
+  size_t *ptr = mmap(NULL, kChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  assert(ptr != MAP_FAILED);
+  // Mark fences
+  *ptr = kFenceValue;
+  *((size_t *)(((size_t)ptr) + kChunkSize - kFenceSize)) = kFenceValue;
+  // Initialize block metadata
+  Block *block = (Block *)(ptr + 1);
+  block->free = false;
+  block->size = kChunkSize - (kFenceSize << 1);
+  block->left_size = kFenceSize;
+  block->prev = NULL;
+  block->next = NULL;
+  void *end = (void *)(((size_t)ptr) + kChunkSize);
+  // Try merge bottom chunks
+  if (bottom != NULL && bottom == end)
+  {
+    // Merge chunks
+    assert(is_fence(get_left_block(bottom_block)));
+    if (bottom_block->free && bottom_block->size + kChunkSize <= kMaxBlockSize)
+    {
+      remove_block(bottom_block);
+      block->size = bottom_block->size + kChunkSize;
+      Block *right = get_right_block(bottom_block);
+      if (!is_fence(right))
+        right->left_size = block->size;
+      // The absorbed block may also be the top block
+      if (bottom_block == top_block)
+        top_block = block;
+    }
+    else
+    {
+      block->size = kChunkSize;
+      bottom_block->left_size = kChunkSize;
+    }
+  }
+  // Update bottom cursor
+  if (bottom == NULL || (size_t)ptr < (size_t)bottom)
+  {
+    bottom = (void *)ptr;
+    bottom_block = block;
+  }
+  // Try merge top chunks
+  if (top != NULL && top == ptr)
+  {
+    // Merge chunks
+    Block *right = get_right_block(top_block);
+    assert(is_fence(right));
+    if (top_block->free && top_block->size + kChunkSize <= kMaxBlockSize)
+    {
+      remove_block(top_block);
+      top_block->free = false;
+      top_block->size += kChunkSize;
+      top_block->prev = NULL;
+      top_block->next = NULL;
+      block = top_block;
+    }
+    else
+    {
+      right->free = false;
+      right->size = kChunkSize;
+      right->left_size = top_block->size;
+      right->prev = NULL;
+      right->next = NULL;
+      block = right;
+    }
+  }
+  // Update top cursor
+  if ((size_t)ptr > (size_t)top)
+  {
+    top = (void *)(((size_t)ptr) + kChunkSize);
+    top_block = block;
+  }
+  return block;
+}
+
+/// Split a block into two
+static Block *split(Block *block, size_t size)
+{
+
+  // Split block
+  size_t total_size = block->size;
+  Block *first = block;
+  first->free = true;
+  first->size = total_size - size;
+  assert(first->size >= kBlockMetadataSize);
+  Block *second = get_right_block(first);
+  second->size = size;
+  second->left_size = first->size;
+  second->free = false;
+  second->prev = NULL;
+  second->next = NULL;
+  assert(first != second);
+  // Update the right neighbour of the second block
+  Block *right = get_right_block(second);
+  if (!is_fence(right))
+    right->left_size = second->size;
+  // Update top block
+  if (block == top_block)
+    top_block = second;
+  return second;
+}
+
+void *my_malloc(size_t size)
+{
+  // Round up allocation size
+  size = size_align_up(size, kAlignment);
+  if (size == 0 || size > kMaxAllocationSize)
+    return NULL;
+  size_t block_size = max(size + kBlockFixedMetadataSize, kBlockMetadataSize);
+  // Find a block
+  Block *block = find_suitable_block(block_size);
+  if (block != NULL)
+    remove_block(block);
+  else
+    block = acquire_more_memory(size);
+  assert(block != NULL);
+  block->free = false;
+  // Split block
+  if (block->size >= block_size + kBlockMetadataSize + kMinAllocationSize)
+  {
+    Block *second = split(block, block_size);
+    Block *first = block;
+    add_block(first);
+    block = second;
+  }
+  // Zero memory and return
+  void *data = block_to_data(block);
+  assert(block->size >= size + kBlockFixedMetadataSize);
+  memset(data, 0, size);
+  LOG("alloc %p size=%zu block=%p\n", data, size, (void *)block);
+  return data;
+}
+
+void my_free(void *ptr)
+{
+  if (ptr == NULL)
+    return;
+  Block *block = data_to_block(ptr);
+  LOG("free %p size=%zu block=%p\n", ptr, block->size - kBlockFixedMetadataSize, (void *)block);
+  assert(!block->free);
+  block->free = true;
+  // 1. Merge with right neighbour
+  Block *right = get_right_block(block);
+  if (!is_fence(right) && right->free && block->size + right->size <= kMaxBlockSize)
+  {
+    remove_block(right);
+    block->size += right->size;
+    if (right == top_block)
+      top_block = block;
+  }
+  // 2. Merge with left neighbour
+  Block *left = get_left_block(block);
+  if (!is_fence(left) && left->free && left->size + block->size <= kMaxBlockSize)
+  {
+    remove_block(left);
+    left->size += block->size;
+    if (block == top_block)
+      top_block = left;
+    block = left;
+  }
+  // Update the right neighbour of the merged block
+  Block *right_right = get_right_block(block);
+  if (!is_fence(right_right))
+    right_right->left_size = block->size;
+  // Add block to freelist
+  add_block(block);
+}
@@ -0,0 +1,279 @@
+// Standard allocation functions on top of mymalloc5, so that it can replace the C library allocator
+// of unmodified programs:
+//
+//   make preload RELEASE=1 && LD_PRELOAD=./out/libmymalloc5_preload.so python3
+//
+// C++ operators are defined by their mangled names, for the Itanium ABI of LP64 targets.
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "mymalloc.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/// Defined by libstdc++ if the program links it
+extern void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+/// Fail a throwing operator new
+static void bad_alloc(void)
+{
+  if (_ZSt17__throw_bad_allocv != NULL)
+    _ZSt17__throw_bad_allocv();
+  abort();
+}
+
+/// Set errno if an allocation failed
+inline static void *check(void *ptr)
+{
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+static size_t page_size(void)
+{
+  static size_t size = 0;
+  if (size == 0)
+    size = (size_t)sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+EXPORT void *malloc(size_t size)
+{
+  // malloc(0) returns a unique pointer
+  return check(my_malloc(size != 0 ? size : 1));
+}
+
+EXPORT void free(void *ptr)
+{
+  my_free(ptr);
+}
+
+// C23 free_sized and free_aligned_sized
+EXPORT void free_sized(void *ptr, size_t size)
+{
+  // malloc(0) allocated 1 byte
+  my_free_sized(ptr, size != 0 ? size : 1);
+}
+
+EXPORT void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+  USE(alignment);
+  USE(size);
+  my_free(ptr);
+}
+
+EXPORT void *calloc(size_t count, size_t size)
+{
+  if (count == 0 || size == 0)
+    count = size = 1;
+  return check(my_calloc(count, size));
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+  if (ptr == NULL && size == 0)
+    size = 1;
+  void *data = my_realloc(ptr, size);
+  // A failed realloc keeps the old object, and realloc(ptr, 0) frees it
+  return size != 0 ? check(data) : data;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t count, size_t size)
+{
+  size_t total;
+  if (__builtin_mul_overflow(count, size, &total))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, total);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  return my_posix_memalign(memptr, alignment, size != 0 ? size : 1);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+  return check(my_aligned_alloc(alignment, size != 0 ? size : 1));
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+  // Round the alignment up to a power of two, like the C library does
+  size_t a = sizeof(void *);
+  while (a < alignment && a != 0)
+    a <<= 1;
+  if (a == 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned_alloc(a, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+  return aligned_alloc(page_size(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+  size_t page = page_size();
+  if (size > kMaxAllocationSize)
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+  return my_malloc_usable_size(ptr);
+}
+
+static void *cxx_new(size_t size)
+{
+  void *data = my_malloc(size != 0 ? size : 1);
+  if (data == NULL)
+    bad_alloc();
+  return data;
+}
+
+static void *cxx_new_aligned(size_t size, size_t alignment)
+{
+  void *data = my_aligned_alloc(alignment, size != 0 ? size : 1);
+  if (data == NULL)
+    bad_alloc();
+  return data;
+}
+
+// operator new(size_t) and operator new[](size_t)
+EXPORT void *_Znwm(size_t size)
+{
+  return cxx_new(size);
+}
+
+EXPORT void *_Znam(size_t size)
+{
+  return cxx_new(size);
+}
+
+// operator new(size_t, const std::nothrow_t &) and operator new[](size_t, const std::nothrow_t &)
+EXPORT void *_ZnwmRKSt9nothrow_t(size_t size, const void *tag)
+{
+  USE(tag);
+  return my_malloc(size != 0 ? size : 1);
+}
+
+EXPORT void *_ZnamRKSt9nothrow_t(size_t size, const void *tag)
+{
+  USE(tag);
+  return my_malloc(size != 0 ? size : 1);
+}
+
+// operator new(size_t, std::align_val_t) and operator new[](size_t, std::align_val_t)
+EXPORT void *_ZnwmSt11align_val_t(size_t size, size_t alignment)
+{
+  return cxx_new_aligned(size, alignment);
+}
+
+EXPORT void *_ZnamSt11align_val_t(size_t size, size_t alignment)
+{
+  return cxx_new_aligned(size, alignment);
+}
+
+// operator new(size_t, std::align_val_t, const std::nothrow_t &) and its array form
+EXPORT void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void *tag)
+{
+  USE(tag);
+  return my_aligned_alloc(alignment, size != 0 ? size : 1);
+}
+
+EXPORT void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void *tag)
+{
+  USE(tag);
+  return my_aligned_alloc(alignment, size != 0 ? size : 1);
+}
+
+// operator delete(void *) and operator delete[](void *)
+EXPORT void _ZdlPv(void *ptr)
+{
+  my_free(ptr);
+}
+
+EXPORT void _ZdaPv(void *ptr)
+{
+  my_free(ptr);
+}
+
+// operator delete(void *, size_t) and operator delete[](void *, size_t)
+EXPORT void _ZdlPvm(void *ptr, size_t size)
+{
+  // new(0) allocated 1 byte
+  my_free_sized(ptr, size != 0 ? size : 1);
+}
+
+EXPORT void _ZdaPvm(void *ptr, size_t size)
+{
+  my_free_sized(ptr, size != 0 ? size : 1);
+}
+
+// operator delete(void *, const std::nothrow_t &) and operator delete[](void *, const std::nothrow_t &)
+EXPORT void _ZdlPvRKSt9nothrow_t(void *ptr, const void *tag)
+{
+  USE(tag);
+  my_free(ptr);
+}
+
+EXPORT void _ZdaPvRKSt9nothrow_t(void *ptr, const void *tag)
+{
+  USE(tag);
+  my_free(ptr);
+}
+
+// operator delete(void *, std::align_val_t) and operator delete[](void *, std::align_val_t)
+EXPORT void _ZdlPvSt11align_val_t(void *ptr, size_t alignment)
+{
+  USE(alignment);
+  my_free(ptr);
+}
+
+EXPORT void _ZdaPvSt11align_val_t(void *ptr, size_t alignment)
+{
+  USE(alignment);
+  my_free(ptr);
+}
+
+// operator delete(void *, size_t, std::align_val_t) and operator delete[](void *, size_t, std::align_val_t)
+EXPORT void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t alignment)
+{
+  USE(size);
+  USE(alignment);
+  my_free(ptr);
+}
+
+EXPORT void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t alignment)
+{
+  USE(size);
+  USE(alignment);
+  my_free(ptr);
+}
+
+// operator delete(void *, std::align_val_t, const std::nothrow_t &) and its array form
+EXPORT void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *tag)
+{
+  USE(alignment);
+  USE(tag);
+  my_free(ptr);
+}
+
+EXPORT void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *tag)
+{
+  USE(alignment);
+  USE(tag);
+  my_free(ptr);
+}
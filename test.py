@@ -30,6 +30,7 @@ def setup_parser(parser: ArgumentParser()):
     parser.add_argument("-t", "--test", help="test name to run", type=str)
     parser.add_argument("--release", help="build in release mode", action="store_true")
     parser.add_argument("--log", help="build with logging", action="store_true")
+    parser.add_argument("--threads", help="build the thread-safe variant", action="store_true")
     parser.add_argument("-m", "--malloc", type=str, help="allocator name, default to \"mymalloc\"")
 
 
@@ -156,6 +157,8 @@ def main():
         build_cmd += "RELEASE=1 "
     if args.log:
         build_cmd += "LOG=1 "
+    if args.threads:
+        build_cmd += "THREADS=1 "
 
     output, exit_code = make(build_cmd, script_path)
     check_make(build_cmd, output, exit_code)
@@ -172,6 +175,9 @@ def main():
         check_make("test", output, exit_code)
 
         run_tests(script_path / "tests", script_path)
+        malloc_tests_path = script_path / "tests" / (args.malloc or "mymalloc")
+        if malloc_tests_path.is_dir():
+            run_tests(malloc_tests_path, script_path)
 
     failed = TOTAL_FAILS
     timedout = TOTAL_TIMEOUTS
@@ -0,0 +1,52 @@
+#include "../testing.h"
+#include <errno.h>
+#include <string.h>
+
+#define NALLOCS 64
+
+static size_t sizes[] = {1, 24, 64, 100, 256, 300, 5000, 100000, 3 << 20};
+
+int main()
+{
+    assert(my_aligned_alloc(24, 100) == NULL);
+    void *ptr;
+    assert(my_posix_memalign(&ptr, 4, 100) == EINVAL);
+    assert(my_posix_memalign(&ptr, 48, 100) == EINVAL);
+
+    // Cache-line aligned small objects are packed without slack
+    unsigned char *a = my_aligned_alloc(64, 64);
+    unsigned char *b = my_aligned_alloc(64, 64);
+    CHECK_NULL(a);
+    CHECK_NULL(b);
+    assert(b - a == 64);
+    freeing(a);
+    freeing(b);
+
+    static void *ptrs[NALLOCS];
+    for (size_t alignment = 16; alignment <= (4 << 20); alignment <<= 1)
+    {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            for (size_t i = 0; i < NALLOCS; i++)
+            {
+                if (i & 1)
+                {
+                    ptrs[i] = my_aligned_alloc(alignment, sizes[s]);
+                    CHECK_NULL(ptrs[i]);
+                }
+                else
+                {
+                    assert(my_posix_memalign(&ptrs[i], alignment, sizes[s]) == 0);
+                }
+                assert(((size_t)ptrs[i] & (alignment - 1)) == 0);
+                memset(ptrs[i], (int)i, sizes[s]);
+            }
+            for (size_t i = 0; i < NALLOCS; i++)
+            {
+                assert(((unsigned char *)ptrs[i])[sizes[s] - 1] == (unsigned char)i);
+                freeing(ptrs[i]);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
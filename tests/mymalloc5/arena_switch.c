@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include "../testing.h"
+
+// Contention is simulated by interposing pthread_mutex_trylock, which needs the dynamic linker of Linux
+#if defined(ENABLE_THREADS) && defined(__linux__)
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#define NALLOCS 64
+// Large enough to bypass the thread caches, so frees of other threads go to the remote free list
+#define SIZE (64 << 10)
+
+static void *ptrs[NALLOCS];
+static pthread_barrier_t barrier;
+static __thread bool contended;
+
+/// Make the next trylock of this thread fail, as if its arena were busy
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    static int (*real_trylock)(pthread_mutex_t *);
+    if (contended)
+    {
+        contended = false;
+        return EBUSY;
+    }
+    if (real_trylock == NULL)
+        *(void **)&real_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+    return real_trylock(mutex);
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+    for (size_t i = 0; i < NALLOCS; i++)
+        ptrs[i] = mallocing(SIZE);
+    pthread_barrier_wait(&barrier);
+    // The main thread frees the objects of this thread's arena
+    pthread_barrier_wait(&barrier);
+    // Switch to another arena, leaving the first one without threads
+    contended = true;
+    freeing(mallocing(SIZE));
+    return NULL;
+}
+
+int main()
+{
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, NULL);
+    pthread_barrier_wait(&barrier);
+    freeing_loop(ptrs, NALLOCS);
+    pthread_barrier_wait(&barrier);
+    pthread_join(thread, NULL);
+    // The remote frees of the arena the thread left are not stranded
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    assert(stats.in_use == 0);
+}
+#else
+int main()
+{
+    // Single-threaded build, or no interposition: nothing to test
+}
+#endif
@@ -0,0 +1,93 @@
+#include "../testing.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#define NALLOCS 1000
+
+static const size_t kSizes[] = {24, 256, 1000, 5000, 2 << 20};
+
+/// Shuffle pointers, so the batch free has to sort them
+static void shuffle(void **ptrs, size_t n)
+{
+    size_t seed = 1;
+    for (size_t i = n - 1; i > 0; i--)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        size_t j = (seed >> 33) % (i + 1);
+        void *tmp = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+}
+
+#ifdef ENABLE_THREADS
+/// Free a batch that locks the arena of this thread, then frees an object of another arena through
+/// a full thread cache, whose flush takes that lock again
+static void *free_remote(void *remote)
+{
+    // A fresh thread cache holds exactly these objects
+    void *own[64];
+    void *slab = mallocing(100);
+    for (size_t i = 0; i < 64; i++)
+        own[i] = mallocing(32);
+    for (size_t i = 0; i < 64; i++)
+        freeing(own[i]);
+    void *batch[] = {slab, remote};
+    my_free_batch(batch, 2);
+    return NULL;
+}
+#endif
+
+int main()
+{
+    static void *ptrs[NALLOCS + 1];
+    for (size_t s = 0; s < sizeof(kSizes) / sizeof(kSizes[0]); s++)
+    {
+        size_t size = kSizes[s];
+        size_t n = size > (1 << 20) ? 8 : NALLOCS;
+        assert(my_malloc_batch(size, n, ptrs) == n);
+        for (size_t i = 0; i < n; i++)
+        {
+            assert(ptrs[i] != NULL && ((uintptr_t)ptrs[i] & 7) == 0);
+            assert(my_malloc_usable_size(ptrs[i]) >= size);
+            memset(ptrs[i], (int)i, size);
+        }
+        // Objects do not overlap
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = 0; j < size; j += 64)
+                assert(((unsigned char *)ptrs[i])[j] == (unsigned char)i);
+        if (size == 5000)
+        {
+            // Blocks are carved next to each other
+            size_t adjacent = 0;
+            for (size_t i = 0; i + 1 < n; i++)
+                adjacent += (char *)ptrs[i + 1] - (char *)ptrs[i] == (char *)ptrs[1] - (char *)ptrs[0];
+            assert(adjacent > n / 2);
+        }
+        shuffle(ptrs, n);
+        ptrs[n] = NULL;
+        my_free_batch(ptrs, n + 1);
+    }
+    assert(my_malloc_batch(0, 4, ptrs) == 0);
+    my_free_batch(ptrs, 0);
+
+    // Freed blocks are merged into one free block
+    MallocStats stats;
+    assert(my_malloc_batch(5000, NALLOCS, ptrs) == NALLOCS);
+    shuffle(ptrs, NALLOCS);
+    my_free_batch(ptrs, NALLOCS);
+    my_malloc_stats(&stats);
+    assert(stats.largest_free >= NALLOCS * 5000);
+    assert(stats.mallocs == stats.frees);
+
+#ifdef ENABLE_THREADS
+    // Objects of another arena are freed without holding the lock of the batch
+    pthread_t thread;
+    void *remote = mallocing(32);
+    pthread_create(&thread, NULL, free_remote, remote);
+    pthread_join(thread, NULL);
+#endif
+}
@@ -0,0 +1,41 @@
+#include "../testing.h"
+
+#define NALLOCS 4096
+
+static int is_inside(char *block, size_t size, void *ptr)
+{
+    return (char *)ptr >= block && (char *)ptr < block + size;
+}
+
+int main()
+{
+    // Separators keep the freed blocks from coalescing
+    char *a = mallocing(10000);
+    mallocing(512);
+    char *b = mallocing(5000);
+    mallocing(512);
+    char *c = mallocing(7000);
+    mallocing(512);
+    freeing(c);
+    freeing(b);
+    freeing(a);
+    // The smallest free block that fits is taken, not the first one
+    void *ptr = mallocing(6000);
+    assert(is_inside(c, 7000, ptr));
+
+    // Churn many general blocks, including blocks of equal size
+    static void *ptrs[NALLOCS];
+    size_t seed = 42;
+    for (int j = 0; j < 8; j++)
+    {
+        for (size_t i = 0; i < NALLOCS; i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            size_t size = (seed >> 60) < 4 ? 1024 : 480 + (seed >> 33) % 65536;
+            if (ptrs[i] != NULL)
+                freeing(ptrs[i]);
+            ptrs[i] = (seed >> 59) & 1 ? mallocing(size) : NULL;
+        }
+    }
+    freeing_loop(ptrs, NALLOCS);
+}
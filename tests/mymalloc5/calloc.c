@@ -0,0 +1,53 @@
+#include "../testing.h"
+#include <stdint.h>
+#include <string.h>
+
+#define NALLOCS 512
+
+static size_t sizes[] = {24, 200, 300, 1000, 1004, 5000, 100000, 3 << 20, 20 << 20};
+
+static void check_zero(unsigned char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        assert(ptr[i] == 0);
+}
+
+int main()
+{
+    // Overflowing requests fail
+    assert(my_calloc(SIZE_MAX / 2 + 1, 2) == NULL);
+    assert(my_calloc(SIZE_MAX, SIZE_MAX) == NULL);
+    assert(my_calloc(0, 8) == NULL);
+
+    static unsigned char *ptrs[NALLOCS];
+    for (size_t round = 0; round < 4; round++)
+    {
+        for (size_t i = 0; i < NALLOCS; i++)
+        {
+            size_t size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+            if (size > 100000 && i >= 64)
+                size = 777;
+            // Dirty memory from plain allocations is cleared for calloc
+            ptrs[i] = (i + round) & 1 ? mallocing(size) : my_calloc(1, size);
+            CHECK_NULL(ptrs[i]);
+            if ((i + round) & 1)
+                memset(ptrs[i], 0xff, size);
+            else
+                check_zero(ptrs[i], size);
+        }
+        for (size_t i = round & 1; i < NALLOCS; i += 2)
+            freeing(ptrs[i]);
+        for (size_t i = 0; i < NALLOCS; i++)
+        {
+            if ((i & 1) == (round & 1))
+            {
+                ptrs[i] = my_calloc(4, 250);
+                CHECK_NULL(ptrs[i]);
+                check_zero(ptrs[i], 1000);
+            }
+        }
+        for (size_t i = 0; i < NALLOCS; i++)
+            freeing(ptrs[i]);
+    }
+    return EXIT_SUCCESS;
+}
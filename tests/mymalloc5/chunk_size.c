@@ -0,0 +1,62 @@
+#include "../testing.h"
+#include <string.h>
+#include <unistd.h>
+
+#define MB (1ull << 20)
+
+/// Size of the address space in bytes
+static size_t mapped(void)
+{
+    size_t pages;
+    FILE *f = fopen("/proc/self/statm", "r");
+    assert(f != NULL);
+    assert(fscanf(f, "%zu", &pages) == 1);
+    fclose(f);
+    return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/// Record the size of the largest slab chunk
+static void largest_slab_chunk(const HeapEntry *entry, void *arg)
+{
+    size_t *largest = arg;
+    if (entry->kind == kHeapSlabChunk && entry->size > *largest)
+        *largest = entry->size;
+}
+
+int main()
+{
+    size_t base = mapped();
+    // A small heap only maps small chunks
+    void *small = mallocing(1000);
+    CHECK_NULL(small);
+    void *tiny = mallocing(16);
+    CHECK_NULL(tiny);
+    printf("small heap: %zuKB\n", (mapped() - base) >> 10);
+    assert(mapped() < base + 4 * MB);
+    // A large heap gets larger chunks, which are at most half of what is mapped
+    static void *ptrs[4096];
+    for (size_t i = 0; i < 4096; i++)
+    {
+        ptrs[i] = mallocing(256 << 10);
+        CHECK_NULL(ptrs[i]);
+        memset(ptrs[i], 1, 4096);
+    }
+    printf("large heap: %zuMB\n", (mapped() - base) >> 20);
+    assert(mapped() < base + 2048 * MB);
+    // Slab chunks do not grow with the heap, since they are never unmapped
+    static void *objects[1 << 16];
+    for (size_t i = 0; i < (1 << 16); i++)
+    {
+        objects[i] = mallocing(64);
+        CHECK_NULL(objects[i]);
+    }
+    size_t largest = 0;
+    my_heap_walk(largest_slab_chunk, &largest);
+    printf("largest slab chunk: %zuKB\n", largest >> 10);
+    assert(largest <= 2 * MB);
+    freeing_loop(objects, 1 << 16);
+    freeing_loop(ptrs, 4096);
+    freeing(small);
+    freeing(tiny);
+    return EXIT_SUCCESS;
+}
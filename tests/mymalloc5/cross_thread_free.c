@@ -0,0 +1,59 @@
+#include "../testing.h"
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+
+#define NTHREADS 8
+#define NALLOCS 2048
+
+static void *ptrs[NTHREADS][NALLOCS];
+
+static void *allocate(void *arg)
+{
+    size_t t = (size_t)arg;
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        // Mix small (cached) and large (arena) allocations
+        size_t size = (i & 7) == 0 ? 4096 + i : 8 + (i % 512);
+        ptrs[t][i] = mallocing(size);
+        assert(ptrs[t][i] != NULL);
+        *(size_t *)ptrs[t][i] = t;
+    }
+    return NULL;
+}
+
+static void *release(void *arg)
+{
+    // Free the allocations of another thread
+    size_t t = ((size_t)arg + 1) % NTHREADS;
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        assert(*(size_t *)ptrs[t][i] == t);
+        freeing(ptrs[t][i]);
+    }
+    return NULL;
+}
+
+static void run(void *(*fn)(void *))
+{
+    pthread_t threads[NTHREADS];
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, fn, (void *)i);
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+}
+
+int main()
+{
+    for (int i = 0; i < 8; i++)
+    {
+        run(allocate);
+        run(release);
+    }
+}
+#else
+int main()
+{
+    // Single-threaded build: nothing to test
+}
+#endif
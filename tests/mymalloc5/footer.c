@@ -0,0 +1,45 @@
+#include "../testing.h"
+#include <string.h>
+
+#define SIZE 1004
+
+static void check(unsigned char *ptr, size_t size, unsigned char value)
+{
+    for (size_t i = 0; i < size; i++)
+        assert(ptr[i] == value);
+}
+
+int main()
+{
+    // Allocated blocks have a 4 byte header, and their data covers the footer in the next block
+    unsigned char *a = mallocing(SIZE);
+    unsigned char *b = mallocing(SIZE);
+    unsigned char *c = mallocing(SIZE);
+    unsigned char *d = mallocing(SIZE);
+    CHECK_NULL(a);
+    CHECK_NULL(b);
+    CHECK_NULL(c);
+    CHECK_NULL(d);
+    assert(my_malloc_usable_size(b) == SIZE);
+    assert(b - a == SIZE + 4 || a - b == SIZE + 4);
+    memset(a, 'a', SIZE);
+    memset(b, 'b', SIZE);
+    memset(c, 'c', SIZE);
+    memset(d, 'd', SIZE);
+
+    // Freed blocks write their footers, and coalesce with their free neighbours on both sides
+    MallocStats before, after;
+    my_malloc_stats(&before);
+    freeing(b);
+    check(a, SIZE, 'a');
+    check(c, SIZE, 'c');
+    freeing(c);
+    check(a, SIZE, 'a');
+    check(d, SIZE, 'd');
+    my_malloc_stats(&after);
+    assert(after.coalesces == before.coalesces + 1);
+    freeing(a);
+    freeing(d);
+    my_malloc_stats(&after);
+    assert(after.coalesces >= before.coalesces + 3);
+}
@@ -0,0 +1,53 @@
+#include "../testing.h"
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NALLOCS 256
+
+int main()
+{
+    // Small objects of every slab class, blocks, and huge objects
+    void *ptrs[NALLOCS];
+    size_t sizes[NALLOCS];
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        sizes[i] = i < NALLOCS - 4 ? 1 + i * 13 : (i - NALLOCS + 5) << 20;
+        ptrs[i] = i % 3 == 0 ? my_calloc(1, sizes[i]) : mallocing(sizes[i]);
+        CHECK_NULL(ptrs[i]);
+        memset(ptrs[i], (int)i, sizes[i]);
+    }
+    // Resized objects are freed with their last size
+    for (size_t i = 1; i < NALLOCS; i += 7)
+    {
+        sizes[i] = sizes[i] * 3 / 2 + 1;
+        ptrs[i] = my_realloc(ptrs[i], sizes[i]);
+        CHECK_NULL(ptrs[i]);
+    }
+    for (size_t i = 0; i < NALLOCS; i++)
+        my_free_sized(ptrs[i], sizes[i]);
+
+    // Freed small objects are reused
+    void *small = mallocing(24);
+    my_free_sized(small, 24);
+    assert(mallocing(24) == small);
+    my_free_sized(small, 17);
+    my_free_sized(NULL, 24);
+
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    assert(stats.frees == stats.mallocs);
+
+#ifdef ENABLE_CHECK_FREE_SIZE
+    // A size of another slab class is caught
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(STDERR_FILENO);
+        my_free_sized(mallocing(24), 200);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+#endif
+}
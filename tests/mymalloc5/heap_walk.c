@@ -0,0 +1,86 @@
+#include "../testing.h"
+#include <string.h>
+
+#define NALLOCS 256
+
+typedef struct Totals
+{
+    size_t chunks;
+    size_t chunk_bytes;
+    size_t allocated;
+    size_t free;
+    size_t blocks;
+    void *last;
+} Totals;
+
+static void *ptrs[NALLOCS];
+static int found[NALLOCS];
+
+static void count(const HeapEntry *entry, void *arg)
+{
+    Totals *totals = arg;
+    // Entries come in address order, chunks before their contents
+    assert(entry->kind == kHeapBlockChunk || entry->kind == kHeapSlabChunk || (char *)entry->start >= (char *)totals->last);
+    totals->last = entry->start;
+    switch (entry->kind)
+    {
+    case kHeapBlockChunk:
+    case kHeapSlabChunk:
+        totals->chunks += 1;
+        totals->chunk_bytes += entry->size;
+        break;
+    case kHeapBlock:
+        totals->blocks += 1;
+        if (entry->free)
+            totals->free += entry->size;
+        else
+            totals->allocated += entry->size;
+        assert(entry->usable < entry->size);
+        break;
+    case kHeapSlabPage:
+        assert(entry->n_free <= entry->n_objects && entry->n_objects * entry->usable <= entry->size);
+        totals->allocated += (entry->n_objects - entry->n_free) * entry->usable;
+        break;
+    }
+    if (entry->kind == kHeapBlock || entry->kind == kHeapSlabPage)
+    {
+        char *end = (char *)entry->start + entry->size;
+        for (int i = 0; i < NALLOCS; i++)
+        {
+            if (ptrs[i] != NULL && (char *)ptrs[i] > (char *)entry->start && (char *)ptrs[i] < end)
+            {
+                assert(!entry->free);
+                found[i] += 1;
+            }
+        }
+    }
+}
+
+int main()
+{
+    size_t seed = 1;
+    for (int i = 0; i < NALLOCS; i++)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        ptrs[i] = mallocing(8 + (seed >> 33) % 8192);
+    }
+    // Leave holes
+    for (int i = 0; i < NALLOCS; i += 3)
+    {
+        freeing(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+    Totals totals;
+    memset(&totals, 0, sizeof(totals));
+    my_heap_walk(count, &totals);
+    for (int i = 0; i < NALLOCS; i++)
+        assert(ptrs[i] == NULL || found[i] == 1);
+    // The walk agrees with the statistics
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    assert(totals.chunks == stats.chunks && totals.chunk_bytes == stats.mapped);
+    assert(totals.free == stats.free && totals.allocated == stats.in_use);
+    assert(totals.blocks > 0);
+    for (int i = 0; i < NALLOCS; i++)
+        freeing(ptrs[i]);
+}
@@ -0,0 +1,49 @@
+#include "../testing.h"
+#include <string.h>
+
+#define MB (1ull << 20)
+
+static void fill(unsigned char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i += 4096)
+        ptr[i] = (unsigned char)(i >> 12);
+    ptr[size - 1] = 0xab;
+}
+
+static void check(unsigned char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size - 1; i += 4096)
+        assert(ptr[i] == (unsigned char)(i >> 12));
+}
+
+int main()
+{
+    // Larger than a chunk
+    unsigned char *ptr = mallocing(64 * MB);
+    CHECK_NULL(ptr);
+    fill(ptr, 64 * MB);
+    // Grow without losing data
+    ptr = my_realloc(ptr, 160 * MB);
+    CHECK_NULL(ptr);
+    check(ptr, 64 * MB);
+    assert(ptr[64 * MB - 1] == 0xab);
+    fill(ptr, 160 * MB);
+    // Shrink in place
+    ptr = my_realloc(ptr, 32 * MB);
+    CHECK_NULL(ptr);
+    check(ptr, 32 * MB);
+    // Move back into a chunk
+    ptr = my_realloc(ptr, 4000);
+    CHECK_NULL(ptr);
+    check(ptr, 4000);
+    freeing(ptr);
+    // Mid-size buffers freed repeatedly
+    for (size_t i = 0; i < 64; i++)
+    {
+        ptr = mallocing(2 * MB);
+        CHECK_NULL(ptr);
+        fill(ptr, 2 * MB);
+        freeing(ptr);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+#include "../testing.h"
+
+#ifdef ENABLE_INSTRUMENT
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NALLOCS 1024
+#define HUGE_SIZE (8 << 20)
+
+int main()
+{
+    // Objects of the slab, of the lists and of the general size class, and a huge one
+    void *ptrs[NALLOCS];
+    for (size_t i = 0; i < NALLOCS; i++)
+        ptrs[i] = mallocing(8 + (i * 37) % 4096);
+    void *huge = mallocing(HUGE_SIZE);
+    for (size_t i = 0; i < NALLOCS; i++)
+        freeing(ptrs[i]);
+    freeing(huge);
+
+    char path[] = "/tmp/mymalloc5_instrument_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(my_malloc_latency_print(fd) == 0);
+    close(fd);
+    FILE *f = fopen(path, "r");
+    assert(f != NULL);
+    char line[256];
+    size_t mallocs = 0, frees = 0, huge_mallocs = 0, huge_frees = 0, lookups = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char name[32];
+        unsigned long long calls, p50, p99, p999, max;
+        if (sscanf(line, "%31s %llu %llu %llu %llu %llu", name, &calls, &p50, &p99, &p999, &max) != 6)
+            continue;
+        // Percentiles are bounded by the next one
+        assert(p50 <= p99 && p99 <= p999 && p999 <= max);
+        if (strncmp(name, "malloc_", 7) == 0)
+            mallocs += calls;
+        else if (strncmp(name, "free_", 5) == 0)
+            frees += calls;
+        else if (strcmp(name, "classes_skipped") == 0)
+            lookups = calls;
+        if (strcmp(name, "malloc_huge") == 0)
+            huge_mallocs = calls;
+        if (strcmp(name, "free_huge") == 0)
+            huge_frees = calls;
+    }
+    fclose(f);
+    unlink(path);
+    // Every call is counted once, towards its slowest path
+    assert(mallocs == NALLOCS + 1 && frees == NALLOCS + 1);
+    assert(huge_mallocs >= 1 && huge_frees >= 1);
+    assert(lookups > 0);
+}
+#else
+int main()
+{
+    // Built without instrumentation: nothing to test
+}
+#endif
@@ -0,0 +1,72 @@
+#include "../testing.h"
+
+#define GB (1ull << 30)
+#define SIZE (1 << 20)
+#define NALLOCS 6144
+
+/// Longest run of adjacent allocated blocks, in bytes and blocks
+typedef struct Run
+{
+    char *end;
+    size_t bytes;
+    size_t blocks;
+    size_t longest_bytes;
+    size_t longest_blocks;
+} Run;
+
+static void find_run(const HeapEntry *entry, void *arg)
+{
+    Run *run = arg;
+    if (entry->kind != kHeapBlock)
+        return;
+    if (entry->free || (char *)entry->start != run->end)
+    {
+        run->bytes = 0;
+        run->blocks = 0;
+    }
+    if (!entry->free)
+    {
+        run->bytes += entry->size;
+        run->blocks += 1;
+    }
+    run->end = (char *)entry->start + entry->size;
+    if (run->bytes > run->longest_bytes)
+    {
+        run->longest_bytes = run->bytes;
+        run->longest_blocks = run->blocks;
+    }
+}
+
+int main()
+{
+    // 6GB of address space in blocks. Chunks are mapped below each other and merged.
+    static void *ptrs[NALLOCS];
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        ptrs[i] = mallocing(SIZE);
+        CHECK_NULL(ptrs[i]);
+    }
+    Run run = {0};
+    my_heap_walk(find_run, &run);
+    printf("longest run: %zuMB in %zu blocks\n", run.longest_bytes >> 20, run.longest_blocks);
+    // The kernel does not always map chunks next to each other
+    if (run.longest_bytes <= 4 * GB)
+    {
+        printf("skipped: no run above 4GB\n");
+        return EXIT_SUCCESS;
+    }
+
+    // A batch free merges each run into one block, which is then coalesced with its free neighbours
+    MallocStats before, after;
+    my_malloc_stats(&before);
+    my_free_batch(ptrs, NALLOCS);
+    my_malloc_stats(&after);
+    assert(after.coalesces - before.coalesces >= run.longest_blocks - 1);
+    assert(after.in_use < before.in_use - 4 * GB);
+
+    // The heap is still usable
+    for (size_t i = 0; i < 64; i++)
+        ptrs[i] = mallocing(SIZE);
+    freeing_loop(ptrs, 64);
+    return EXIT_SUCCESS;
+}
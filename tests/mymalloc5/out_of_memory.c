@@ -0,0 +1,48 @@
+#include "../testing.h"
+#include <unistd.h>
+
+#define MAX_ALLOCS (4 << 20)
+#define HEADROOM (64 << 20)
+
+static void *ptrs[MAX_ALLOCS];
+
+/// Address space of the process in bytes
+static size_t address_space(void)
+{
+    size_t pages;
+    FILE *f = fopen("/proc/self/statm", "r");
+    assert(f != NULL);
+    assert(fscanf(f, "%zu", &pages) == 1);
+    fclose(f);
+    return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/// Allocate objects of a size until the allocator runs out of memory. Returns the number of objects.
+static size_t exhaust(size_t size, size_t n)
+{
+    for (size_t i = n; i < MAX_ALLOCS; i++)
+    {
+        if ((ptrs[i] = mallocing(size)) == NULL)
+            return i;
+    }
+    assert(!"the address space limit was not reached");
+    return MAX_ALLOCS;
+}
+
+int main()
+{
+    set_mem_limit(address_space() + HEADROOM);
+    // Slab objects, then blocks, return NULL once no chunk can be mapped
+    size_t n = exhaust(64, 0);
+    assert(n > 0);
+    n = exhaust(1000, n);
+    void *batch[16];
+    assert(my_malloc_batch(64, 16, batch) < 16 || my_malloc_batch(1000, 16, batch) < 16);
+    for (size_t i = 0; i < n; i++)
+        freeing(ptrs[i]);
+    // The heap is still usable
+    void *ptr = mallocing(64);
+    CHECK_NULL(ptr);
+    freeing(ptr);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include "../testing.h"
+#include <dlfcn.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NTHREADS 8
+#define NALLOCS 4096
+
+/// Check if a function is defined by the preloaded library
+static int is_preloaded(const char *name)
+{
+    Dl_info info;
+    return dladdr(dlsym(RTLD_DEFAULT, name), &info) != 0 && strstr(info.dli_fname, "_preload") != NULL;
+}
+
+static void *worker(void *arg)
+{
+    size_t seed = (size_t)arg;
+    static __thread void *ptrs[NALLOCS];
+    for (int j = 0; j < 16; j++)
+    {
+        for (int i = 0; i < NALLOCS; i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            size_t size = 1 + (seed >> 33) % 2048;
+            switch (i % 4)
+            {
+            case 0:
+                ptrs[i] = malloc(size);
+                break;
+            case 1:
+                ptrs[i] = calloc(1, size);
+                for (size_t k = 0; k < size; k++)
+                    assert(((char *)ptrs[i])[k] == 0);
+                break;
+            case 2:
+                ptrs[i] = aligned_alloc(64, size);
+                assert(((uintptr_t)ptrs[i] & 63) == 0);
+                break;
+            default:
+                ptrs[i] = realloc(malloc(8), size);
+                break;
+            }
+            assert(ptrs[i] != NULL);
+            // Objects that can hold a long double or an SSE vector are aligned for it
+            assert(size <= 8 || ((uintptr_t)ptrs[i] & 15) == 0);
+            assert(malloc_usable_size(ptrs[i]) >= size);
+            memset(ptrs[i], 0xab, size);
+        }
+        for (int i = 0; i < NALLOCS; i++)
+            free(ptrs[(i * 7) % NALLOCS]);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    USE(argc);
+    if (!is_preloaded("malloc"))
+    {
+        // Run again with the C library allocator replaced
+        Dl_info info;
+        assert(dladdr(dlsym(RTLD_DEFAULT, "my_malloc"), &info) != 0);
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/libmymalloc5_preload.so", dirname(strdup(info.dli_fname)));
+        assert(access(path, R_OK) == 0);
+        setenv("LD_PRELOAD", path, 1);
+        execv("/proc/self/exe", argv);
+        return EXIT_FAILURE;
+    }
+    assert(is_preloaded("free") && is_preloaded("calloc") && is_preloaded("realloc"));
+    // Objects of the C library and of the allocator are the same
+    char *str = strdup("preload");
+    my_free(str);
+    void *ptr = malloc(0);
+    assert(ptr != NULL);
+    free(ptr);
+    assert(posix_memalign(&ptr, 4096, 100) == 0 && ((uintptr_t)ptr & 4095) == 0);
+    free(ptr);
+    // operator new returns __STDCPP_DEFAULT_NEW_ALIGNMENT__ aligned objects, as malloc does
+    void *(*cxx_new)(size_t);
+    *(void **)&cxx_new = dlsym(RTLD_DEFAULT, "_Znwm");
+    assert(cxx_new != NULL);
+    for (size_t size = 16; size <= (2 << 20); size = size * 3 / 2 + 4)
+    {
+        void *object = cxx_new(size);
+        void *data = malloc(size);
+        assert(((uintptr_t)object & 15) == 0 && ((uintptr_t)data & 15) == 0);
+        free(object);
+        free(data);
+    }
+    // Threads allocate through the thread cache
+    pthread_t threads[NTHREADS];
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+    // The heap stays usable in a forked child
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        worker((void *)42);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
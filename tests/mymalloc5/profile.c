@@ -0,0 +1,86 @@
+#include "../testing.h"
+
+#ifdef ENABLE_PROFILE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NALLOCS 64
+#define SIZE 1000
+#define SMALL 24
+
+/// Dump the heap profile, and return its number of samples and their bytes
+static size_t dump(size_t *bytes)
+{
+    char path[] = "/tmp/mymalloc5_profile_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(my_heap_profile_dump(fd) == 0);
+    close(fd);
+    FILE *f = fopen(path, "r");
+    assert(f != NULL);
+    size_t count, rate;
+    assert(fscanf(f, "heap profile: %zu: %zu [%*u: %*u] @ heap_v2/%zu\n", &count, bytes, &rate) == 3);
+    size_t n = 0, total = 0, size;
+    while (fscanf(f, "1: %zu [1: %*u] @", &size) == 1)
+    {
+        // Each sample has a call stack
+        void *frame;
+        assert(fscanf(f, " %p", &frame) == 1 && frame != NULL);
+        fscanf(f, "%*[^\n]\n");
+        total += size;
+        n++;
+    }
+    char line[64];
+    assert(fgets(line, sizeof(line), f) != NULL && strcmp(line, "MAPPED_LIBRARIES:\n") == 0);
+    assert(n == count && total == *bytes);
+    fclose(f);
+    unlink(path);
+    return count;
+}
+
+int main()
+{
+    // Every allocation but the first of the thread is sampled
+    my_set_sample_rate(1);
+    void *ptrs[NALLOCS];
+    for (size_t i = 0; i < NALLOCS; i++)
+        ptrs[i] = mallocing(SIZE);
+    void *aligned = my_aligned_alloc(4096, SIZE);
+    assert(((uintptr_t)aligned & 4095) == 0);
+    // Sampled objects keep their usual layout
+    void *small = mallocing(SMALL);
+    assert(my_malloc_usable_size(small) < 2 * SMALL);
+    void *batch[4];
+    assert(my_malloc_batch(SMALL, 4, batch) == 4);
+    size_t bytes;
+    assert(dump(&bytes) == NALLOCS + 5 && bytes == NALLOCS * SIZE + 5 * SMALL);
+
+    // Samples leave the profile whichever way their objects are freed
+    my_free_sized(small, SMALL);
+    my_free_batch(batch, 4);
+    assert(dump(&bytes) == NALLOCS && bytes == NALLOCS * SIZE);
+
+    for (size_t i = 0; i < NALLOCS; i += 2)
+        freeing(ptrs[i]);
+    freeing(aligned);
+    assert(dump(&bytes) == NALLOCS / 2 && bytes == NALLOCS / 2 * SIZE);
+    // A sampled object keeps its sample when it is resized
+    ptrs[1] = my_realloc(ptrs[1], 2 * SIZE);
+    assert(dump(&bytes) == NALLOCS / 2 && bytes == (NALLOCS / 2 + 1) * SIZE);
+
+    // A rate of 0 stops sampling
+    my_set_sample_rate(0);
+    for (size_t i = 0; i < NALLOCS; i += 2)
+        ptrs[i] = mallocing(SIZE);
+    assert(dump(&bytes) == NALLOCS / 2);
+    for (size_t i = 0; i < NALLOCS; i++)
+        freeing(ptrs[i]);
+    assert(dump(&bytes) == 0 && bytes == 0);
+}
+#else
+int main()
+{
+    // Built without profiling: nothing to test
+}
+#endif
@@ -0,0 +1,79 @@
+#include "../testing.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NALLOCS 2048
+#define SIZE (32 << 10)
+#define NSMALL (1 << 20)
+#define SMALL_SIZE 64
+
+/// Resident set size in bytes
+static size_t rss(void)
+{
+    size_t pages, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    assert(f != NULL);
+    assert(fscanf(f, "%zu %zu", &pages, &resident) == 2);
+    fclose(f);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+int main()
+{
+    my_set_purge_decay(10);
+    static void *ptrs[NALLOCS];
+    // A burst of 64MB
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        ptrs[i] = mallocing(SIZE);
+        CHECK_NULL(ptrs[i]);
+        memset(ptrs[i], 1, SIZE);
+    }
+    size_t peak = rss();
+    freeing_loop(ptrs, NALLOCS);
+    // Idle for longer than the decay period, then keep allocating a little
+    struct timespec idle = {0, 50 * 1000 * 1000};
+    nanosleep(&idle, NULL);
+    for (size_t i = 0; i < 64; i++)
+        freeing(mallocing(SIZE));
+    size_t after = rss();
+    printf("peak=%zuKB after=%zuKB\n", peak >> 10, after >> 10);
+    assert(after + (32 << 20) < peak);
+    // Purged memory is reused
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        ptrs[i] = my_calloc(1, SIZE);
+        CHECK_NULL(ptrs[i]);
+        for (size_t j = 0; j < SIZE; j += 512)
+            assert(((unsigned char *)ptrs[i])[j] == 0);
+    }
+    freeing_loop(ptrs, NALLOCS);
+#ifndef ENABLE_HUGEPAGES
+    // A burst of 64MB of slab objects, whose empty pages are purged too
+    static void *small[NSMALL];
+    for (size_t i = 0; i < NSMALL; i++)
+    {
+        small[i] = mallocing(SMALL_SIZE);
+        CHECK_NULL(small[i]);
+        memset(small[i], 1, SMALL_SIZE);
+    }
+    peak = rss();
+    freeing_loop(small, NSMALL);
+    nanosleep(&idle, NULL);
+    for (size_t i = 0; i < 64; i++)
+        freeing(mallocing(SIZE));
+    after = rss();
+    printf("slab peak=%zuKB after=%zuKB\n", peak >> 10, after >> 10);
+    assert(after + (32 << 20) < peak);
+    // Purged slab pages are reused
+    for (size_t i = 0; i < NSMALL; i++)
+    {
+        small[i] = my_calloc(1, SMALL_SIZE);
+        CHECK_NULL(small[i]);
+        assert(((unsigned char *)small[i])[SMALL_SIZE - 1] == 0);
+    }
+    freeing_loop(small, NSMALL);
+#endif
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#include "../testing.h"
+#include <string.h>
+
+static void sort(unsigned char **ptrs, size_t n)
+{
+    for (size_t i = 1; i < n; i++)
+        for (size_t j = i; j > 0 && ptrs[j - 1] > ptrs[j]; j--)
+        {
+            unsigned char *tmp = ptrs[j];
+            ptrs[j] = ptrs[j - 1];
+            ptrs[j - 1] = tmp;
+        }
+}
+
+int main()
+{
+    // Slab objects stay in place within their size class
+    unsigned char *small = mallocing(20);
+    CHECK_NULL(small);
+    memset(small, 7, 20);
+    assert(my_realloc(small, 30) == small);
+    small = my_realloc(small, 200);
+    CHECK_NULL(small);
+    for (size_t i = 0; i < 20; i++)
+        assert(small[i] == 7);
+
+    unsigned char *ptrs[3];
+    for (size_t i = 0; i < 3; i++)
+        ptrs[i] = mallocing(1000);
+    sort(ptrs, 3);
+    unsigned char *ptr = ptrs[0];
+    memset(ptr, 1, 1000);
+    // Grow into the free right neighbour
+    freeing(ptrs[1]);
+    assert(my_realloc(ptr, 1500) == ptr);
+    memset(ptr, 2, 1500);
+    // Shrink in place, then expand again without moving
+    assert(my_realloc(ptr, 600) == ptr);
+    assert(my_try_expand(ptr, 1900, 2000) >= 1900);
+    // The next block is allocated
+    assert(my_try_expand(ptr, 100000, 100000) == 0);
+    for (size_t i = 0; i < 600; i++)
+        assert(ptr[i] == 2);
+    // Move when growing in place is impossible
+    ptr = my_realloc(ptr, 100000);
+    CHECK_NULL(ptr);
+    for (size_t i = 0; i < 600; i++)
+        assert(ptr[i] == 2);
+    freeing(ptr);
+    freeing(ptrs[2]);
+    freeing(small);
+
+    // Growing buffers
+    for (size_t i = 0; i < 64; i++)
+    {
+        unsigned char *buf = NULL;
+        for (size_t size = 1; size <= (1 << 20); size <<= 1)
+        {
+            buf = my_realloc(buf, size);
+            CHECK_NULL(buf);
+            buf[size - 1] = (unsigned char)size;
+            if (size > 1)
+                assert(buf[(size >> 1) - 1] == (unsigned char)(size >> 1));
+        }
+        freeing(buf);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,31 @@
+#include "../testing.h"
+#include <string.h>
+
+#define NALLOCS 4096
+
+int main()
+{
+    static unsigned char *ptrs[NALLOCS];
+    for (size_t size = 1; size <= 256; size += 7)
+    {
+        for (size_t i = 0; i < NALLOCS; i++)
+        {
+            ptrs[i] = mallocing(size);
+            assert(ptrs[i] != NULL);
+            assert(((size_t)ptrs[i] & (sizeof(size_t) - 1)) == 0);
+            memset(ptrs[i], (int)i, size);
+        }
+        // Objects of the same size class are packed densely without headers
+        if (size == 15)
+            assert(ptrs[1] - ptrs[0] == 16);
+        for (size_t i = 0; i < NALLOCS; i++)
+        {
+            for (size_t j = 0; j < size; j++)
+                assert(ptrs[i][j] == (unsigned char)i);
+            if (i & 1)
+                freeing(ptrs[i]);
+        }
+        for (size_t i = 0; i < NALLOCS; i += 2)
+            freeing(ptrs[i]);
+    }
+}
@@ -0,0 +1,48 @@
+#define _GNU_SOURCE
+#include "../testing.h"
+
+// Chunks are kept apart by interposing mmap, which needs the dynamic linker of Linux
+#ifdef __linux__
+#include <dlfcn.h>
+#include <sys/mman.h>
+
+#define NALLOCS (16 << 10)
+#define SIZE (32 << 10)
+
+/// Map a page where a chunk would be placed next to the chunk above it, so chunks do not touch
+/// and are not merged
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+    if (real_mmap == NULL)
+        *(void **)&real_mmap = dlsym(RTLD_NEXT, "mmap");
+    if (addr != NULL && (flags & MAP_FIXED) == 0)
+        real_mmap((char *)addr + length - 4096, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int main()
+{
+    static void *ptrs[NALLOCS];
+    // A burst of 512MB grows the chunks to hundreds of MB
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        ptrs[i] = mallocing(SIZE);
+        CHECK_NULL(ptrs[i]);
+    }
+    // Free from the last one, so the largest chunks are emptied first
+    for (size_t i = NALLOCS; i > 0; i--)
+        freeing(ptrs[i - 1]);
+    // The spare chunks are bounded by bytes, so the large chunks are unmapped
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    printf("mapped=%zuMB chunks=%zu\n", stats.mapped >> 20, stats.chunks);
+    assert(stats.mapped <= (64 << 20));
+    return EXIT_SUCCESS;
+}
+#else
+int main()
+{
+    return EXIT_SUCCESS;
+}
+#endif
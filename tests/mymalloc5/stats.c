@@ -0,0 +1,102 @@
+#include "../testing.h"
+#include <string.h>
+#include <unistd.h>
+
+#define NALLOCS 32
+#define SIZE 4096
+#define MB (1ull << 20)
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+
+#define NTHREADS 4
+
+static void *worker(void *arg)
+{
+    USE(arg);
+    for (int i = 0; i < 1000; i++)
+        freeing(mallocing(64));
+    return NULL;
+}
+#endif
+
+static void check_free(MallocStats *stats)
+{
+    size_t free = 0;
+    for (size_t sc = 0; sc <= N_LISTS; sc++)
+        free += stats->free_by_class[sc];
+    assert(free == stats->free);
+    assert(stats->largest_free <= stats->free);
+    assert(stats->in_use + stats->free <= stats->mapped);
+}
+
+int main()
+{
+    MallocStats before, stats;
+    my_malloc_stats(&before);
+    // Blocks of the general size class, which are not cached by threads
+    void *ptrs[NALLOCS];
+    for (int i = 0; i < NALLOCS; i++)
+        ptrs[i] = mallocing(SIZE);
+    my_malloc_stats(&stats);
+    check_free(&stats);
+    assert(stats.mallocs == before.mallocs + NALLOCS);
+    assert(stats.in_use >= before.in_use + NALLOCS * SIZE);
+    assert(stats.chunks >= 1 && stats.mmaps >= 1 && stats.splits >= NALLOCS - 1);
+    // Every other block: no neighbours to coalesce with
+    before = stats;
+    for (int i = 0; i < NALLOCS; i += 2)
+        freeing(ptrs[i]);
+    my_malloc_stats(&stats);
+    check_free(&stats);
+    assert(stats.frees == before.frees + NALLOCS / 2);
+    assert(stats.in_use <= before.in_use - NALLOCS / 2 * SIZE);
+    assert(stats.free_by_class[N_LISTS] >= before.free_by_class[N_LISTS] + NALLOCS / 2 * SIZE);
+    assert(stats.largest_free >= SIZE);
+    // The rest merges with them
+    before = stats;
+    for (int i = 1; i < NALLOCS; i += 2)
+        freeing(ptrs[i]);
+    my_malloc_stats(&stats);
+    check_free(&stats);
+    assert(stats.coalesces >= before.coalesces + NALLOCS - 1);
+    assert(stats.largest_free >= NALLOCS * SIZE);
+    // Huge allocations have their own mapping
+    before = stats;
+    void *huge = mallocing(8 * MB);
+    my_malloc_stats(&stats);
+    assert(stats.huge_mappings == before.huge_mappings + 1 && stats.mmaps > before.mmaps);
+    assert(stats.mapped >= before.mapped + 8 * MB && stats.in_use >= before.in_use + 8 * MB);
+    huge = my_realloc(huge, 16 * MB);
+    freeing(huge);
+    my_malloc_stats(&stats);
+    assert(stats.huge_mappings == before.huge_mappings && stats.mapped == before.mapped);
+    assert(stats.munmaps > before.munmaps && stats.reallocs == before.reallocs + 1);
+#ifdef ENABLE_THREADS
+    // Counters of exited threads are kept
+    before = stats;
+    pthread_t threads[NTHREADS];
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+    my_malloc_stats(&stats);
+    assert(stats.mallocs >= before.mallocs + NTHREADS * 1000 && stats.frees >= before.frees + NTHREADS * 1000);
+#endif
+    // Text dump
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(my_malloc_stats_print(fds[1]) == 0);
+    close(fds[1]);
+    static char text[1 << 16];
+    size_t length = 0;
+    ssize_t n;
+    while ((n = read(fds[0], text + length, sizeof(text) - 1 - length)) > 0)
+        length += n;
+    text[length] = '\0';
+    assert(strstr(text, "# TYPE mymalloc_mapped_bytes gauge\nmymalloc_mapped_bytes ") != NULL);
+    assert(strstr(text, "mymalloc_mallocs_total ") != NULL);
+    assert(strstr(text, "mymalloc_class_free_bytes{size=\"16\"} ") != NULL);
+    assert(strstr(text, "mymalloc_class_free_bytes{size=\"general\"} ") != NULL);
+    assert(text[length - 1] == '\n');
+}
@@ -0,0 +1,51 @@
+#include "../testing.h"
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+
+#define NTHREADS 8
+#define NALLOCS 4096
+
+static void *worker(void *arg)
+{
+    size_t seed = (size_t)arg;
+    void *ptrs[NALLOCS];
+    for (int j = 0; j < 16; j++)
+    {
+        for (int i = 0; i < NALLOCS; i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            size_t size = 8 + (seed >> 33) % 1024;
+            ptrs[i] = mallocing(size);
+            assert(ptrs[i] != NULL);
+            *(size_t *)ptrs[i] = size;
+        }
+        for (int i = 0; i < NALLOCS; i++)
+        {
+            assert(*(size_t *)ptrs[i] >= 8);
+            freeing(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+int main()
+{
+    pthread_t threads[NTHREADS];
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+    for (size_t i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+    // Caches of exited threads are drained back to the shared lists, so nothing is left in use
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    assert(stats.in_use == 0);
+    void *ptr = mallocing(8);
+    freeing(ptr);
+}
+#else
+int main()
+{
+    // Single-threaded build: nothing to test
+}
+#endif
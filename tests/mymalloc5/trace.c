@@ -0,0 +1,74 @@
+#include "../testing.h"
+
+#ifdef ENABLE_TRACE
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../trace.h"
+
+#define NALLOCS 1024
+// More threads than fit in 12 bits
+#define NTHREADS 4100
+
+static void *worker(void *arg)
+{
+    USE(arg);
+    freeing(mallocing(8));
+    return NULL;
+}
+
+int main()
+{
+    char path[] = "/tmp/mymalloc5_trace_XXXXXX";
+    assert(mkstemp(path) >= 0);
+    setenv("MYMALLOC_TRACE", path, 1);
+    // Enough events to fill a thread buffer, which is then written out
+    void *ptrs[NALLOCS];
+    for (size_t i = 0; i < NALLOCS; i++)
+        ptrs[i] = mallocing(i + 1);
+    ptrs[0] = my_realloc(ptrs[0], 4096);
+    for (size_t i = 0; i < NALLOCS; i++)
+        freeing(ptrs[i]);
+
+    FILE *f = fopen(path, "rb");
+    assert(f != NULL);
+    TraceHeader header;
+    assert(fread(&header, sizeof(header), 1, f) == 1);
+    assert(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0 && header.event_size == sizeof(TraceEvent));
+    TraceEvent event;
+    size_t n = 0;
+    while (fread(&event, sizeof(event), 1, f) == 1)
+    {
+        assert(event.seq == n && event.thread == 0);
+        if (n < NALLOCS)
+            assert(event.op == kTraceMalloc && event.size == n + 1);
+        else if (n == NALLOCS)
+            assert(event.op == kTraceRealloc && event.size == 4096 && event.ptr == (uint64_t)ptrs[0]);
+        else
+            assert(event.op == kTraceFree && event.ptr == (uint64_t)ptrs[n - NALLOCS - 1]);
+        n++;
+    }
+    assert(n > 0);
+
+    // Each thread writes its events when it exits
+    for (size_t i = 0; i < NTHREADS; i++)
+    {
+        pthread_t thread;
+        pthread_create(&thread, NULL, worker, NULL);
+        pthread_join(thread, NULL);
+    }
+    clearerr(f);
+    size_t max_thread = 0;
+    while (fread(&event, sizeof(event), 1, f) == 1)
+        max_thread = event.thread > max_thread ? event.thread : max_thread;
+    assert(max_thread == NTHREADS);
+    fclose(f);
+    unlink(path);
+}
+#else
+int main()
+{
+    // Built without tracing: nothing to test
+}
+#endif
@@ -0,0 +1,48 @@
+#include "../testing.h"
+#include <string.h>
+#include <unistd.h>
+
+#define NALLOCS 8192
+#define SIZE (32 << 10)
+
+/// Size of the address space in bytes
+static size_t mapped(void)
+{
+    size_t pages;
+    FILE *f = fopen("/proc/self/statm", "r");
+    assert(f != NULL);
+    assert(fscanf(f, "%zu", &pages) == 1);
+    fclose(f);
+    return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+int main()
+{
+    static void *ptrs[NALLOCS];
+    size_t base = mapped();
+    srand(1);
+    for (int round = 0; round < 4; round++)
+    {
+        // 256MB of blocks, with sizes varying around SIZE
+        for (size_t i = 0; i < NALLOCS; i++)
+        {
+            ptrs[i] = mallocing(SIZE + (rand() % 64) * 64);
+            CHECK_NULL(ptrs[i]);
+            memset(ptrs[i], 1, SIZE);
+        }
+        assert(mapped() > base + (256 << 20));
+        // Free in random order
+        for (size_t i = NALLOCS - 1; i > 0; i--)
+        {
+            size_t j = rand() % (i + 1);
+            void *tmp = ptrs[i];
+            ptrs[i] = ptrs[j];
+            ptrs[j] = tmp;
+        }
+        freeing_loop(ptrs, NALLOCS);
+        // Only the spare chunks and a few chunks holding the fences around them stay mapped
+        printf("round %d: mapped=%zuMB\n", round, (mapped() - base) >> 20);
+        assert(mapped() < base + (64 << 20));
+    }
+    return EXIT_SUCCESS;
+}
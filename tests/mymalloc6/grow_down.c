@@ -0,0 +1,60 @@
+#include "../testing.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CHUNK (16 << 20)
+// Rounds up past the size class of a whole free chunk, so a free chunk never fits it
+#define SIZE ((15 << 20) + (768 << 10))
+
+// Address space for three chunks: the first chunk goes in the middle, the second below it and the third above it
+static char *region;
+static size_t n_chunks;
+static const size_t kChunkSlots[] = {1, 0, 2};
+
+/// Place the chunks of the allocator, which the kernel could map anywhere
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    if (region != NULL && length == CHUNK && n_chunks < 3)
+    {
+        addr = region + kChunkSlots[n_chunks++] * CHUNK;
+        flags |= MAP_FIXED;
+    }
+    return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+static void check(unsigned char *ptr, unsigned char value)
+{
+    for (size_t i = 0; i < SIZE; i += 4096)
+        assert(ptr[i] == value);
+    assert(ptr[SIZE - 1] == value);
+}
+
+int main()
+{
+    region = mmap(NULL, 3 * CHUNK, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(region != MAP_FAILED);
+    // The first chunk then holds a single free block, which is both the top and the bottom block
+    void *a = mallocing(SIZE);
+    CHECK_NULL(a);
+    freeing(a);
+    // The second chunk is mapped below the first and absorbs that block
+    unsigned char *b = mallocing(SIZE);
+    CHECK_NULL(b);
+    memset(b, 'b', SIZE);
+    // Take the rest of the merged block
+    unsigned char *c = mallocing(SIZE);
+    CHECK_NULL(c);
+    memset(c, 'c', SIZE);
+    // The third chunk is mapped above the first and merges with the top block
+    unsigned char *d = mallocing(SIZE);
+    CHECK_NULL(d);
+    memset(d, 'd', SIZE);
+    assert((char *)d > (char *)b);
+    check(b, 'b');
+    check(c, 'c');
+    freeing(b);
+    freeing(c);
+    freeing(d);
+}
@@ -0,0 +1,30 @@
+#include "../testing.h"
+
+#define NALLOCS 64
+
+static size_t sizes[NALLOCS];
+
+static int is_inside(void **ptrs, size_t i, void *ptr)
+{
+    return (char *)ptr >= (char *)ptrs[i] && (char *)ptr < (char *)ptrs[i] + sizes[i];
+}
+
+int main()
+{
+    void *ptrs[NALLOCS];
+    // Sizes across all first-level classes up to ~8MB
+    for (size_t i = 0; i < NALLOCS; i++)
+    {
+        sizes[i] = ((size_t)1 << (i % 24)) + i;
+        ptrs[i] = mallocing(sizes[i]);
+        assert(ptrs[i] != NULL);
+    }
+    for (size_t i = 0; i < NALLOCS; i += 2)
+        freeing(ptrs[i]);
+    // A freed 1MB block is the good fit for a request of 900KB
+    void *ptr = mallocing(900 << 10);
+    assert(is_inside(ptrs, 20, ptr) || is_inside(ptrs, 44, ptr));
+    freeing(ptr);
+    for (size_t i = 1; i < NALLOCS; i += 2)
+        freeing(ptrs[i]);
+}
@@ -0,0 +1,35 @@
+#include <stdint.h>
+
+// Binary allocation traces, recorded by `mymalloc5` built with TRACE=1 and replayed by bench/replay.
+// A trace is a TraceHeader followed by TraceEvents. Threads write their events in batches, so events
+// are only ordered by their sequence numbers.
+
+#define TRACE_MAGIC "mytrace2"
+
+typedef enum TraceOp
+{
+  kTraceMalloc,
+  kTraceCalloc,
+  kTraceRealloc,
+  kTraceAlignedAlloc,
+  kTraceFree,
+} TraceOp;
+
+typedef struct TraceHeader
+{
+  char magic[8];
+  uint32_t event_size;
+  uint32_t pid;
+} TraceHeader;
+
+typedef struct TraceEvent
+{
+  uint64_t seq;       // Global order of the event
+  uint64_t time;      // Nanoseconds since the trace started
+  uint64_t ptr;       // Object allocated or freed, or the result of a realloc
+  uint64_t arg;       // Object passed to a realloc, or the alignment of an aligned allocation
+  uint64_t size : 60; // Requested size
+  uint64_t op : 4;
+  uint32_t thread; // Threads are numbered in the order of their first event
+  uint32_t unused;
+} TraceEvent;